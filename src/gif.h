@@ -29,7 +29,6 @@
                                          GIF_VERSION_MINOR, \
                                          GIF_VERSION_PATCH)
 
-#include <darray.h>
 #include <stdio.h>
 
 enum gif_mode {
@@ -57,6 +56,39 @@ enum gif_tag {
   TAG_TRAILER = 0x3b
 };
 
+enum gif_pixel_format {
+  GIF_RGB8,
+  GIF_RGBA8,
+  GIF_BGRA8,
+  GIF_RGBA8_PREMUL,
+  GIF_RGB565
+};
+
+enum gif_feed_status {
+  GIF_FEED_ERROR = -1,
+  GIF_FEED_MORE,
+  GIF_FEED_FRAME,
+  GIF_FEED_END
+};
+
+/* Reader failures. Each limit in gif_reader_opts has its own code, and so
+ * does a caller's canvas too small for the screen */
+enum gif_error {
+  GIF_ERR = -1,
+  GIF_ERR_PIXELS = -2,
+  GIF_ERR_FRAMES = -3,
+  GIF_ERR_DECODED = -4,
+  GIF_ERR_READ = -5,
+  GIF_ERR_CANVAS = -6
+};
+
+struct gif_frame;
+struct gif_doc;
+struct gif_checkpoint;
+struct gif_lzw;
+struct gif_lzw_decoder;
+struct gif_partial;
+
 /* **************************************** */
 /* gif_reader.c */
 struct gif_reader {
@@ -70,6 +102,10 @@ struct gif_reader {
       unsigned char *ptr;
       long value;
     } start;
+    struct gif_doc *doc;
+    unsigned long offset;
+    unsigned long start_offset;
+    unsigned long size;
   } meta;
   enum gif_version version;
   unsigned int width;
@@ -79,43 +115,231 @@ struct gif_reader {
   unsigned int n_colors;
   unsigned char aspect;
   unsigned char bg_color_index;
+  enum gif_pixel_format format;
+  unsigned int bpp;
   unsigned char has_global_clut;
   unsigned char *global_clut;
   unsigned char *image;
+  unsigned long stride;
+  unsigned long capacity;
+  unsigned char borrowed;
   unsigned char has_local_clut;
   unsigned char *local_clut;
   unsigned char has_trans;
   unsigned char trans_index;
+  struct gif_lzw_decoder *lzw;
   void (*dispose)(struct gif_reader *g);
+  unsigned int frame;
+  unsigned char stale;
+  struct {
+    struct gif_checkpoint *points;
+    unsigned int n_points;
+    unsigned int interval;
+  } cache;
+  struct {
+    unsigned char *buf;
+    unsigned long len;
+    unsigned long pos;
+    unsigned long cap;
+    unsigned long fed;
+    struct gif_partial *partial;
+    unsigned char active;
+    unsigned char begun;
+    unsigned char in_image;
+    unsigned char ended;
+  } stream;
+  struct {
+    unsigned long max_pixels;
+    unsigned int max_frames;
+    unsigned long max_decoded;
+    unsigned long max_read;
+  } limits;
+  unsigned long decoded;
+  int error;
+  struct {
+    unsigned char **table;
+    unsigned char *shared;
+    unsigned char **fills;
+    unsigned int n_fills;
+    unsigned int size;
+    unsigned int cols;
+    unsigned int rows;
+  } tiles;
+};
+
+/* A tile_size other than 0 keeps the canvas in square tiles of that many
+ * pixels instead of g->image, allocated as they are drawn on. A canvas of
+ * canvas_size bytes is used as g->image instead of allocating one, with rows
+ * stride bytes apart or packed for a stride of 0; the reader fails with
+ * GIF_ERR_CANVAS if it can't hold the whole screen. Limits of 0
+ * mean no limit. max_decoded counts from the last gifr_head or checkpoint,
+ * max_read from where the source was when the reader started */
+struct gif_reader_opts {
+  enum gif_pixel_format format;
+  unsigned int tile_size;
+  unsigned char *canvas;
+  unsigned long stride;
+  unsigned long canvas_size;
+  unsigned long max_pixels;
+  unsigned int max_frames;
+  unsigned long max_decoded;
+  unsigned long max_read;
+};
+
+/* A GIF parsed once and shared read-only between readers */
+struct gif_doc {
+  struct gif_reader base;
+  unsigned char *data;
 };
 
 int gifr_init(struct gif_reader *g, enum gif_source_type type, void *src);
+int gifr_init_opts(struct gif_reader *g,
+                   enum gif_source_type type,
+                   void *src,
+                   struct gif_reader_opts *opts);
+int gifr_init_doc(struct gif_reader *g,
+                  struct gif_doc *d,
+                  struct gif_reader_opts *opts);
+int gifr_init_stream(struct gif_reader *g, struct gif_reader_opts *opts);
+int gifr_feed(struct gif_reader *g, unsigned char *bytes, unsigned long len);
 void gifr_deinit(struct gif_reader *g);
 void gifr_head(struct gif_reader *g);
 int gifr_next(struct gif_reader *g);
+int gifr_next_raw(struct gif_reader *g, struct gif_frame *f);
+int gifr_checkpoints(struct gif_reader *g,
+                     unsigned int interval,
+                     unsigned long budget);
+int gifr_seek(struct gif_reader *g, unsigned int n);
+int gifr_set_canvas(struct gif_reader *g,
+                    unsigned char *buf,
+                    unsigned long stride,
+                    unsigned long size,
+                    int keep);
+int gifr_read_rect(struct gif_reader *g,
+                   unsigned int x,
+                   unsigned int y,
+                   unsigned int w,
+                   unsigned int h,
+                   unsigned char *dst,
+                   unsigned long stride);
+unsigned char *gifr_tile(struct gif_reader *g,
+                         unsigned int tx,
+                         unsigned int ty);
+int gifd_init(struct gif_doc *d,
+              enum gif_source_type type,
+              void *src,
+              struct gif_reader_opts *opts);
+void gifd_deinit(struct gif_doc *d);
 /* **************************************** */
 
 /* **************************************** */
 /* gif_writer.c */
+struct gif_opts {
+  unsigned int delay;
+  unsigned char flags;
+  unsigned char trans_index;
+  /* store rows in the four-pass interlaced order */
+  unsigned char interlace;
+};
+
+/* An encoded frame: image descriptor and LZW data. The graphic control block
+ * is kept as opts and only emitted when the frame is written. The index
+ * buffer and LZW tables are scratch space kept for the next encode */
+struct gif_frame {
+  struct gif_opts opts;
+  unsigned char has_opts;
+  size_t len;
+  size_t cap;
+  unsigned char *data;
+  size_t idx_cap;
+  unsigned char *idx;
+  struct gif_lzw *lzw;
+};
+
+/* Caller-supplied worker pool. submit runs job(arg) on a worker and returns a
+ * handle for wait, or NULL to have the job run on the calling thread. wait
+ * blocks until the job behind handle has finished */
+struct gif_pool {
+  void *ctx;
+  void *(*submit)(void *ctx, void (*job)(void *arg), void *arg);
+  void (*wait)(void *ctx, void *handle);
+};
+
+enum gif_writer_flags {
+  /* pack the colors each frame uses into a smaller local table */
+  GIFW_TRIM_CLUT = 0x01,
+  /* extend the previous frame's delay instead of repeating a frame */
+  GIFW_MERGE_DUPLICATES = 0x02
+};
+
+enum gif_effort {
+  GIF_EFFORT_DEFAULT,
+  GIF_EFFORT_LOW,
+  GIF_EFFORT_HIGH
+};
+
 struct gif_writer {
   struct {
     enum gif_source_type dst_type;
     union {
-      struct darray *ptr;
+      unsigned char *ptr;
       FILE *file;
     } dst;
+    size_t len;
+    size_t cap;
+    unsigned char failed;
   } meta;
   unsigned int width;
   unsigned int height;
   unsigned int n_colors;
   unsigned char code_size;
   unsigned char *palette;
-};
-
-struct gif_opts {
-  unsigned int delay;
-  unsigned char flags;
-  unsigned char trans_index;
+  unsigned int flags;
+  enum gif_effort effort;
+  unsigned int lossy;
+  unsigned char *lut;
+  struct {
+    unsigned char *canvas;
+    unsigned char *crop;
+    size_t crop_cap;
+    unsigned char valid;
+  } delta;
+  struct {
+    unsigned long max;
+    unsigned int n_frames;
+    unsigned int seen;
+    unsigned int kept;
+    unsigned int level;
+  } rate;
+  struct gif_frame frame;
+  struct gif_frame held;
+  unsigned char held_frame;
+  struct {
+    unsigned long hash[2];
+    unsigned int left;
+    unsigned int top;
+    unsigned int width;
+    unsigned int height;
+    struct gif_opts opts;
+    unsigned char has_opts;
+    unsigned char valid;
+  } dup;
+  struct {
+    struct gif_pool *pool;
+    struct gif_slot *slots;
+    unsigned int n_slots;
+    unsigned int head;
+    unsigned int count;
+  } queue;
+  struct {
+    struct gif_pool *pool;
+    unsigned int rows;
+  } bands;
+  struct {
+    unsigned int width;
+    unsigned int remaining;
+    unsigned char active;
+  } rows;
 };
 
 int gifw_init(struct gif_writer *g,
@@ -130,6 +354,73 @@ void gifw_push(struct gif_writer *g,
                unsigned int width,
                unsigned int height,
                unsigned char *img);
+void gifw_push_local(struct gif_writer *g,
+                     struct gif_opts *opts,
+                     unsigned char code_size,
+                     unsigned char *palette,
+                     unsigned int left,
+                     unsigned int top,
+                     unsigned int width,
+                     unsigned int height,
+                     unsigned char *img);
+int gifw_encode(struct gif_writer *g,
+                struct gif_opts *opts,
+                unsigned int left,
+                unsigned int top,
+                unsigned int width,
+                unsigned int height,
+                unsigned char *img,
+                struct gif_frame *out);
+int gifw_encode_local(struct gif_writer *g,
+                      struct gif_opts *opts,
+                      unsigned char code_size,
+                      unsigned char *palette,
+                      unsigned int left,
+                      unsigned int top,
+                      unsigned int width,
+                      unsigned int height,
+                      unsigned char *img,
+                      struct gif_frame *out);
+void gifw_write(struct gif_writer *g, struct gif_frame *f);
+void gifw_frame_deinit(struct gif_frame *f);
+int gifw_effort(struct gif_writer *g, enum gif_effort effort);
+int gifw_lossy(struct gif_writer *g, unsigned int threshold);
+int gifw_budget(struct gif_writer *g,
+                unsigned long max_bytes,
+                unsigned int n_frames);
+int gifw_bands(struct gif_writer *g,
+               struct gif_pool *pool,
+               unsigned int rows);
+int gifw_async(struct gif_writer *g,
+               struct gif_pool *pool,
+               unsigned int depth);
+int gifw_push_async(struct gif_writer *g,
+                    struct gif_opts *opts,
+                    unsigned int left,
+                    unsigned int top,
+                    unsigned int width,
+                    unsigned int height,
+                    unsigned char *img);
+void gifw_flush(struct gif_writer *g);
+int gifw_begin_frame(struct gif_writer *g,
+                     struct gif_opts *opts,
+                     unsigned int left,
+                     unsigned int top,
+                     unsigned int width,
+                     unsigned int height);
+int gifw_push_rows(struct gif_writer *g,
+                   unsigned int n_rows,
+                   unsigned char *img);
+int gifw_end_frame(struct gif_writer *g);
+int gifw_finish(struct gif_writer *g,
+                size_t *out_len,
+                unsigned char **out_img);
+int gifw_reset(struct gif_writer *g,
+               unsigned char code_size,
+               unsigned char *palette,
+               unsigned int width,
+               unsigned int height);
+void gifw_deinit(struct gif_writer *g);
 void gifw_end(struct gif_writer *g,
               size_t *out_len,
               unsigned char **out_img);
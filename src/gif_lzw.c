@@ -0,0 +1,112 @@
+/* This file is a part of libgif
+ *
+ * Copyright 2019, Jeffery Stager
+ *
+ * libgif is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libgif is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libgif.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "gif_lzw.h"
+#include <stdlib.h>
+
+/* Fails for a code size whose codes wouldn't fit in 12 bits, clear and end
+ * codes included */
+int gif_lzw_init(struct gif_lzw_decoder *d, unsigned char code_size) {
+  unsigned int c;
+
+  if (!d) return -1;
+  if (code_size < 1 || code_size > 11) return -1;
+  d->in = NULL;
+  d->avail = 0;
+  d->state = GIF_LZW_MORE;
+  d->bits = 0;
+  d->n_bits = 0;
+  d->code_size = code_size;
+  d->width = code_size + 1u;
+  d->next = (1u << code_size) + 2;
+  d->sp = 0;
+  d->prev = -1;
+  d->first = 0;
+  for (c = 0; c < (1u << code_size); ++c) d->suffix[c] = (unsigned char) c;
+  return 0;
+}
+
+/* Decodes at most max indices into out and returns how many it decoded */
+unsigned long gif_lzw_decode(struct gif_lzw_decoder *d,
+                             unsigned char *out,
+                             unsigned long max) {
+  unsigned int clear, code, c;
+  unsigned long n;
+
+  clear = 1u << d->code_size;
+  n = 0;
+  for (;;) {
+    /* what's left of the last string goes out first */
+    while (d->sp && n < max) out[n++] = d->stack[--d->sp];
+    if (n == max || d->state != GIF_LZW_MORE) return n;
+    /* codes are packed LSB first */
+    while (d->n_bits < d->width) {
+      if (!d->avail) return n;
+      d->bits |= (unsigned long) *d->in++ << d->n_bits;
+      d->avail--;
+      d->n_bits += 8;
+    }
+    code = (unsigned int) (d->bits & ((1ul << d->width) - 1));
+    d->bits >>= d->width;
+    d->n_bits -= d->width;
+    if (code == clear) {
+      d->width = d->code_size + 1u;
+      d->next = clear + 2;
+      d->prev = -1;
+      continue;
+    }
+    if (code == clear + 1) {
+      d->state = GIF_LZW_END;
+      continue;
+    }
+    if (d->prev < 0) {
+      if (code > clear) {
+        d->state = GIF_LZW_BAD;
+        continue;
+      }
+      d->first = (unsigned char) code;
+      d->stack[d->sp++] = d->first;
+      d->prev = (int) code;
+      continue;
+    }
+    if (code > d->next) {
+      d->state = GIF_LZW_BAD;
+      continue;
+    }
+    /* the string for code, last index first. A code not in the table yet
+     * is the previous string and its own first index */
+    c = code;
+    if (code == d->next) {
+      d->stack[d->sp++] = d->first;
+      c = (unsigned int) d->prev;
+    }
+    while (c >= clear) {
+      d->stack[d->sp++] = d->suffix[c];
+      c = d->prefix[c];
+    }
+    d->first = (unsigned char) c;
+    d->stack[d->sp++] = d->first;
+    if (d->next < GIF_LZW_MAX_CODES) {
+      d->prefix[d->next] = (unsigned short) d->prev;
+      d->suffix[d->next] = d->first;
+      d->next++;
+      if (d->next == (1u << d->width) && d->width < 12) d->width++;
+    }
+    d->prev = (int) code;
+  }
+}
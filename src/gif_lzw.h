@@ -0,0 +1,60 @@
+/* This file is a part of libgif
+ *
+ * Copyright 2019, Jeffery Stager
+ *
+ * libgif is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libgif is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libgif.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* GIF LZW decoder shared by the reader and the writer's GIF_CHECK_LZW self
+ * check. Not part of the public interface */
+
+#ifndef GIF_LZW_H
+#define GIF_LZW_H
+
+#define GIF_LZW_MAX_CODES 4096
+
+enum gif_lzw_state {
+  GIF_LZW_MORE,
+  GIF_LZW_END,
+  GIF_LZW_BAD
+};
+
+/* Decoding can stop and pick up again anywhere: point in at the next avail
+ * bytes of data, sub-block lengths left out, and call gif_lzw_decode. It
+ * stops once they're used up or out is full, and leaves the rest of them in
+ * in and avail. Anything after the end code or a bad code is left there
+ * too, with state saying which */
+struct gif_lzw_decoder {
+  unsigned char *in;
+  unsigned long avail;
+  enum gif_lzw_state state;
+  unsigned long bits;
+  unsigned int n_bits;
+  unsigned int code_size;
+  unsigned int width;
+  unsigned int next;
+  unsigned int sp;
+  int prev;
+  unsigned char first;
+  unsigned short prefix[GIF_LZW_MAX_CODES];
+  unsigned char suffix[GIF_LZW_MAX_CODES];
+  unsigned char stack[GIF_LZW_MAX_CODES + 1];
+};
+
+int gif_lzw_init(struct gif_lzw_decoder *d, unsigned char code_size);
+unsigned long gif_lzw_decode(struct gif_lzw_decoder *d,
+                             unsigned char *out,
+                             unsigned long max);
+
+#endif
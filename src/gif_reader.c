@@ -17,7 +17,8 @@
  */
 
 #include "gif.h"
-#include <lzw.h>
+#include "gif_lzw.h"
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -27,10 +28,73 @@
 #define APPLICATION_HEADER_SIZE 12
 #define PLAIN_TEXT_HEADER_SIZE 13
 #define IMAGE_DESCRIPTOR_HEADER_SIZE 9
+#define MAX_TILE_SIZE 1024
+#define MAX_TILE_FILLS 16
 
+/* Decoder state after a number of frames, enough to resume from there */
+struct gif_checkpoint {
+  unsigned char *image;
+  unsigned long pos;
+  unsigned int delay;
+  unsigned char has_trans;
+  unsigned char trans_index;
+  void (*dispose)(struct gif_reader *g);
+};
+
+/* Where a frame's image goes on the canvas */
+struct gif_rect {
+  unsigned int left;
+  unsigned int top;
+  unsigned int width;
+  unsigned int height;
+  int interlaced;
+};
+
+/* A streamed frame, drawn a row at a time as its sub-blocks arrive */
+struct gif_partial {
+  struct gif_rect rect;
+  unsigned char *row;
+  unsigned int fill;
+  unsigned int n_rows;
+  unsigned char pixels[4 * 256];
+};
+
+static int set_error(struct gif_reader *g, int error) {
+  if (!g->error) g->error = error;
+  return g->error;
+}
+
+/* Accounts for size more bytes of the source. Once the reader has failed or
+ * would go past max_read or the end of a source of known size nothing more
+ * is read */
+static int in_bounds(struct gif_reader *g, unsigned long size) {
+  unsigned long max;
+
+  if (g->error) return 0;
+  max = g->meta.size;
+  if (max && (g->meta.offset > max || size > max - g->meta.offset)) {
+    set_error(g, GIF_ERR);
+    return 0;
+  }
+  max = g->limits.max_read;
+  if (max && (g->meta.offset > max || size > max - g->meta.offset)) {
+    set_error(g, GIF_ERR_READ);
+    return 0;
+  }
+  g->meta.offset += size;
+  return 1;
+}
+
+/* Bytes that can't be read come back as zeros, which ends any sub-block
+ * chain or tag loop, and g->error says why */
 static void advance_read(struct gif_reader *g, unsigned long size, void *dst) {
-  if (g->meta.src_type == GIF_FILE) {
-    fread(dst, size, 1, g->meta.src.file);
+  if (!in_bounds(g, size)) {
+    memset(dst, 0, size);
+  } else if (g->meta.src_type == GIF_FILE) {
+    if (fread(dst, size, 1, g->meta.src.file) != 1) {
+      memset(dst, 0, size);
+      set_error(g, GIF_ERR);
+    }
   } else {
     memcpy(dst, g->meta.src.ptr, size);
     g->meta.src.ptr += size;
@@ -38,6 +102,7 @@ static void advance_read(struct gif_reader *g, unsigned long size, void *dst) {
 }
 
 static void advance(struct gif_reader *g, unsigned long size) {
+  if (!in_bounds(g, size)) return;
   if (g->meta.src_type == GIF_FILE) {
     fseek(g->meta.src.file, (long) size, SEEK_CUR);
   } else {
@@ -183,18 +248,357 @@ static int skip_section(struct gif_reader *g, enum gif_tag tag) {
   return 0;
 }
 
-static void count_images(struct gif_reader *g) {
+/* Offset of the read position from the first block after the logical
+ * screen */
+static unsigned long tell(struct gif_reader *g) {
+  if (g->meta.src_type == GIF_FILE) {
+    return (unsigned long) (ftell(g->meta.src.file) - g->meta.start.value);
+  }
+  return (unsigned long) (g->meta.src.ptr - g->meta.start.ptr);
+}
+
+static int count_images(struct gif_reader *g) {
   enum gif_tag tag;
 
   tag = TAG_TRAILER;
   do {
     advance_read(g, 1, &tag);
-    if (tag == TAG_IMAGE_DESCRIPTOR) g->n_frames++;
-    skip_section(g, tag);
+    if (tag == TAG_IMAGE_DESCRIPTOR) {
+      if (g->limits.max_frames && g->n_frames == g->limits.max_frames) {
+        return set_error(g, GIF_ERR_FRAMES);
+      }
+      g->n_frames++;
+    }
+    if (skip_section(g, tag) && tag != TAG_TRAILER) {
+      return set_error(g, GIF_ERR);
+    }
+    if (g->error) return g->error;
   } while (tag != TAG_TRAILER);
+  return 0;
+}
+
+static void seek_to(struct gif_reader *g, unsigned long pos) {
+  g->meta.offset = g->meta.start_offset + pos;
+  if (g->meta.src_type == GIF_FILE) {
+    fseek(g->meta.src.file, g->meta.start.value + (long) pos, SEEK_SET);
+  } else {
+    g->meta.src.ptr = g->meta.start.ptr + pos;
+  }
+}
+
+static unsigned long canvas_size(struct gif_reader *g) {
+  return (unsigned long) g->width * g->height * g->bpp;
+}
+
+static unsigned long row_size(struct gif_reader *g) {
+  return (unsigned long) g->width * g->bpp;
+}
+
+/* Whether size bytes, with rows stride bytes apart, hold the whole screen:
+ * (height - 1) * stride + row_size(g) of them, worked out without
+ * overflowing */
+static int canvas_fits(struct gif_reader *g,
+                       unsigned long stride,
+                       unsigned long size) {
+  unsigned long row;
+
+  row = row_size(g);
+  if (stride < row) return 0;
+  if (!row || !g->height) return 1;
+  if (size < row) return 0;
+  return (size - row) / stride >= g->height - 1;
+}
+
+static void copy_rows(struct gif_reader *g,
+                      unsigned char *dst,
+                      unsigned long dst_stride,
+                      unsigned char *src,
+                      unsigned long src_stride) {
+  unsigned int y;
+
+  for (y = 0; y < g->height; ++y) {
+    memcpy(dst + y * dst_stride, src + y * src_stride, row_size(g));
+  }
+}
+
+/* Blanks g->image, which may be the caller's and have padded rows */
+static void clear_canvas(struct gif_reader *g) {
+  unsigned int y;
+
+  if (!g->image) return;
+  if (g->stride == row_size(g)) {
+    memset(g->image, 0, canvas_size(g));
+    return;
+  }
+  for (y = 0; y < g->height; ++y) {
+    memset(g->image + y * g->stride, 0, row_size(g));
+  }
+}
+
+static unsigned long tile_bytes(struct gif_reader *g) {
+  return (unsigned long) g->tiles.size * g->tiles.size * g->bpp;
+}
+
+/* Either g->image or the tile table, with every tile blank */
+static int alloc_canvas(struct gif_reader *g) {
+  unsigned long n;
+
+  if (!g->tiles.size) {
+    if (g->borrowed) {
+      /* the caller's canvas from the options */
+      if (!g->stride) g->stride = row_size(g);
+      if (!canvas_fits(g, g->stride, g->capacity)) {
+        return set_error(g, GIF_ERR_CANVAS);
+      }
+      clear_canvas(g);
+      return 0;
+    }
+    g->stride = row_size(g);
+    g->image = calloc(canvas_size(g), 1);
+    return g->image ? 0 : -1;
+  }
+  g->tiles.cols = (g->width + g->tiles.size - 1) / g->tiles.size;
+  g->tiles.rows = (g->height + g->tiles.size - 1) / g->tiles.size;
+  n = (unsigned long) g->tiles.cols * g->tiles.rows;
+  if (!n) n = 1;
+  g->tiles.table = calloc(n, sizeof(unsigned char *));
+  if (!g->tiles.table) return -1;
+  g->tiles.shared = calloc(n, 1);
+  if (!g->tiles.shared) return -1;
+  g->tiles.fills = calloc(MAX_TILE_FILLS, sizeof(unsigned char *));
+  if (!g->tiles.fills) return -1;
+  return 0;
+}
+
+/* Drops every tile, leaving a blank canvas */
+static void clear_tiles(struct gif_reader *g) {
+  unsigned long i, n;
+
+  if (!g->tiles.table) return;
+  n = (unsigned long) g->tiles.cols * g->tiles.rows;
+  for (i = 0; i < n; ++i) {
+    if (g->tiles.table[i] && !g->tiles.shared[i]) free(g->tiles.table[i]);
+    g->tiles.table[i] = NULL;
+    g->tiles.shared[i] = 0;
+  }
+  for (i = 0; i < g->tiles.n_fills; ++i) free(g->tiles.fills[i]);
+  g->tiles.n_fills = 0;
+}
+
+static void free_tiles(struct gif_reader *g) {
+  clear_tiles(g);
+  if (g->tiles.table) free(g->tiles.table);
+  if (g->tiles.shared) free(g->tiles.shared);
+  if (g->tiles.fills) free(g->tiles.fills);
+  g->tiles.table = NULL;
+  g->tiles.shared = NULL;
+  g->tiles.fills = NULL;
+}
+
+/* Tile at column tx, row ty, made the reader's own so it can be drawn on.
+ * Blank tiles are allocated here and shared ones copied */
+static unsigned char *own_tile(struct gif_reader *g,
+                               unsigned int tx,
+                               unsigned int ty) {
+  unsigned char *tile, *copy;
+  unsigned long i;
+
+  i = (unsigned long) ty * g->tiles.cols + tx;
+  tile = g->tiles.table[i];
+  if (tile && !g->tiles.shared[i]) return tile;
+  if (tile) {
+    copy = malloc(tile_bytes(g));
+    if (!copy) return NULL;
+    memcpy(copy, tile, tile_bytes(g));
+  } else {
+    copy = calloc(tile_bytes(g), 1);
+    if (!copy) return NULL;
+  }
+  g->tiles.table[i] = copy;
+  g->tiles.shared[i] = 0;
+  return copy;
+}
+
+/* Gives up a tile that has been drawn all one pixel value: a blank tile is
+ * freed, any other becomes a reference to the shared fill of that value */
+static void settle_tile(struct gif_reader *g,
+                        unsigned int tx,
+                        unsigned int ty) {
+  unsigned char *tile, zero[4];
+  unsigned int x, y, w, h, bpp, size;
+  unsigned long i;
+
+  i = (unsigned long) ty * g->tiles.cols + tx;
+  tile = g->tiles.table[i];
+  if (!tile || g->tiles.shared[i]) return;
+  bpp = g->bpp;
+  size = g->tiles.size;
+  /* edge tiles only count the part on the canvas */
+  w = g->width - tx * size;
+  if (w > size) w = size;
+  h = g->height - ty * size;
+  if (h > size) h = size;
+  for (y = 0; y < h; ++y) {
+    unsigned char *row;
+
+    row = tile + (unsigned long) y * size * bpp;
+    for (x = 0; x < w; ++x) {
+      if (memcmp(row + x * bpp, tile, bpp)) return;
+    }
+  }
+  memset(zero, 0, sizeof(zero));
+  if (!memcmp(tile, zero, bpp)) {
+    free(tile);
+    g->tiles.table[i] = NULL;
+    return;
+  }
+  for (x = 0; x < g->tiles.n_fills; ++x) {
+    if (!memcmp(g->tiles.fills[x], tile, bpp)) {
+      free(tile);
+      g->tiles.table[i] = g->tiles.fills[x];
+      g->tiles.shared[i] = 1;
+      return;
+    }
+  }
+  if (g->tiles.n_fills == MAX_TILE_FILLS) return;
+  /* the tile itself becomes the fill, padding included */
+  for (x = 1; x < size * size; ++x) {
+    memcpy(tile + (unsigned long) x * bpp, tile, bpp);
+  }
+  g->tiles.fills[g->tiles.n_fills++] = tile;
+  g->tiles.shared[i] = 1;
+}
+
+static void free_checkpoints(struct gif_reader *g) {
+  unsigned int i;
+
+  if (!g->cache.points) return;
+  for (i = 0; i < g->cache.n_points; ++i) {
+    if (g->cache.points[i].image) free(g->cache.points[i].image);
+  }
+  free(g->cache.points);
+  memset(&g->cache, 0, sizeof(g->cache));
+}
+
+/* Saves the decoder state if a checkpoint is due and not taken yet */
+static void take_checkpoint(struct gif_reader *g) {
+  struct gif_checkpoint *c;
+
+  if (!g->cache.points || g->stale) return;
+  if (g->frame % g->cache.interval) return;
+  c = &g->cache.points[g->frame / g->cache.interval - 1];
+  if (c->image) return;
+  c->image = malloc(canvas_size(g));
+  /* out of memory just means no checkpoint here */
+  if (!c->image) return;
+  copy_rows(g, c->image, row_size(g), g->image, g->stride);
+  c->pos = tell(g);
+  c->delay = g->delay;
+  c->has_trans = g->has_trans;
+  c->trans_index = g->trans_index;
+  c->dispose = g->dispose;
+}
+
+static void restore_checkpoint(struct gif_reader *g, unsigned int frame) {
+  struct gif_checkpoint *c;
+
+  c = &g->cache.points[frame / g->cache.interval - 1];
+  copy_rows(g, g->image, g->stride, c->image, row_size(g));
+  seek_to(g, c->pos);
+  g->delay = c->delay;
+  g->has_trans = c->has_trans;
+  g->trans_index = c->trans_index;
+  g->dispose = c->dispose;
+  g->frame = frame;
+  g->stale = 0;
+  g->decoded = 0;
+  g->error = 0;
+}
+
+static int set_tile_size(struct gif_reader *g, struct gif_reader_opts *opts) {
+  g->tiles.size = opts ? opts->tile_size : 0;
+  return g->tiles.size > MAX_TILE_SIZE ? -1 : 0;
+}
+
+/* Takes the caller's canvas from opts, if any. Tiled canvases can't use one */
+static int set_canvas(struct gif_reader *g, struct gif_reader_opts *opts) {
+  if (!opts || !opts->canvas) return 0;
+  if (g->tiles.size) return -1;
+  g->image = opts->canvas;
+  g->stride = opts->stride;
+  g->capacity = opts->canvas_size;
+  g->borrowed = 1;
+  return 0;
+}
+
+/* Takes the limits set in opts, keeping the current ones for any left at 0 */
+static void set_limits(struct gif_reader *g, struct gif_reader_opts *opts) {
+  if (!opts) return;
+  if (opts->max_pixels) g->limits.max_pixels = opts->max_pixels;
+  if (opts->max_frames) g->limits.max_frames = opts->max_frames;
+  if (opts->max_decoded) g->limits.max_decoded = opts->max_decoded;
+  if (opts->max_read) g->limits.max_read = opts->max_read;
+}
+
+/* Checks the logical screen and frame count against the limits before
+ * anything is allocated for them */
+static int check_limits(struct gif_reader *g) {
+  unsigned long n_pixels;
+
+  n_pixels = (unsigned long) g->width * g->height;
+  /* a canvas of 4 bytes per pixel has to be addressable */
+  if (n_pixels > ULONG_MAX / 4) return set_error(g, GIF_ERR_PIXELS);
+  if (g->limits.max_pixels && n_pixels > g->limits.max_pixels) {
+    return set_error(g, GIF_ERR_PIXELS);
+  }
+  if (g->limits.max_frames && g->n_frames > g->limits.max_frames) {
+    return set_error(g, GIF_ERR_FRAMES);
+  }
+  return 0;
+}
+
+static int parse_stream(struct gif_reader *g) {
+  g->global_clut = calloc(3 * 256, 1);
+  if (!g->global_clut) return -1;
+  if (header(g)) return -1;
+  if (logical_screen(g)) return -1;
+  if (g->error) return g->error;
+  if (check_limits(g)) return g->error;
+  g->meta.start_offset = g->meta.offset;
+  if (g->meta.src_type == GIF_FILE) {
+    g->meta.start.value = ftell(g->meta.src.file);
+  } else {
+    g->meta.start.ptr = g->meta.src.ptr;
+  }
+  return count_images(g);
 }
 
-static void graphic_control(struct gif_reader *g) {
+/* Reads the rest of file into memory, setting the size of the source */
+static unsigned char *read_file(struct gif_reader *g, FILE *file) {
+  unsigned char *data;
+  long start, end;
+
+  start = ftell(file);
+  if (fseek(file, 0, SEEK_END)) return NULL;
+  end = ftell(file);
+  if (fseek(file, start, SEEK_SET)) return NULL;
+  if (end <= start) return NULL;
+  if (g->limits.max_read
+      && (unsigned long) (end - start) > g->limits.max_read) {
+    set_error(g, GIF_ERR_READ);
+    return NULL;
+  }
+  data = malloc((unsigned long) (end - start));
+  if (!data) return NULL;
+  if (fread(data, (unsigned long) (end - start), 1, file) != 1) {
+    free(data);
+    return NULL;
+  }
+  g->meta.size = (unsigned long) (end - start);
+  return data;
+}
+
+static void graphic_control(struct gif_reader *g, struct gif_frame *f) {
   unsigned char header[GRAPHIC_CONTROL_HEADER_SIZE];
 
   advance_read(g, GRAPHIC_CONTROL_HEADER_SIZE, header);
@@ -206,51 +610,89 @@ static void graphic_control(struct gif_reader *g) {
   } else {
     g->has_trans = 0;
   }
+  if (f) {
+    f->has_opts = 1;
+    f->opts.flags = header[1];
+    f->opts.delay = g->delay;
+    f->opts.trans_index = header[4];
+  }
 }
 
-static long get_data_size(struct gif_reader *g) {
-  unsigned char size;
-  long total;
+/* Reads up to and including the next image descriptor tag, handling any
+ * graphic control block on the way. Returns 0 at the trailer */
+static int next_image(struct gif_reader *g, struct gif_frame *f) {
+  enum gif_tag tag;
 
-  total = 0;
-  if (g->meta.src_type == GIF_FILE) {
-    long start;
-
-    start = ftell(g->meta.src.file);
-    do {
-      fread(&size, 1, 1, g->meta.src.file);
-      total += size;
-      fseek(g->meta.src.file, size, SEEK_CUR);
-    } while (size);
-    fseek(g->meta.src.file, start, SEEK_SET);
-  } else {
-    unsigned char *start;
+  tag = TAG_TRAILER;
+  for (;;) {
+    advance_read(g, 1, &tag);
+    switch (tag) {
+      case TAG_GRAPHIC_CONTROL_LABEL:
+        graphic_control(g, f);
+        break;
+      case TAG_IMAGE_DESCRIPTOR:
+        return 1;
+      default:
+        if (skip_section(g, tag)) return 0;
+    }
+  }
+}
+
+static int frame_reserve(struct gif_frame *f, unsigned long size) {
+  unsigned char *tmp;
+  size_t cap;
+
+  if (f->len + size <= f->cap) return 0;
+  cap = f->cap ? f->cap : 256;
+  while (cap < f->len + size) cap *= 2;
+  tmp = realloc(f->data, cap);
+  if (!tmp) return -1;
+  f->data = tmp;
+  f->cap = cap;
+  return 0;
+}
+
+static int raw_bytes(struct gif_reader *g,
+                     struct gif_frame *f,
+                     unsigned long size) {
+  if (frame_reserve(f, size)) return -1;
+  advance_read(g, size, f->data + f->len);
+  f->len += size;
+  return 0;
+}
+
+/* Copies an image descriptor, its local color table and its LZW data as they
+ * are in the source. The descriptor tag has already been read */
+static int raw_image(struct gif_reader *g, struct gif_frame *f) {
+  unsigned char flags, size;
 
-    start = g->meta.src.ptr;
-    do {
-      size = *g->meta.src.ptr++;
-      total += size;
-      g->meta.src.ptr += size;
-    } while (size);
-    g->meta.src.ptr = start;
+  if (frame_reserve(f, 1)) return -1;
+  f->data[f->len++] = TAG_IMAGE_DESCRIPTOR;
+  if (raw_bytes(g, f, IMAGE_DESCRIPTOR_HEADER_SIZE)) return -1;
+  flags = f->data[f->len - 1];
+  if (flags & 0x80) {
+    if (raw_bytes(g, f, local_color_table_size(flags & 0x07))) return -1;
   }
-  return total;
+  /* LZW code size, then data sub-blocks up to the terminator */
+  if (raw_bytes(g, f, 1)) return -1;
+  do {
+    if (raw_bytes(g, f, 1)) return -1;
+    size = f->data[f->len - 1];
+    if (raw_bytes(g, f, size)) return -1;
+  } while (size);
+  return 0;
 }
 
-static void parse_image_descriptor(struct gif_reader *g,
-                                   unsigned int *out_left,
-                                   unsigned int *out_top,
-                                   unsigned int *out_width,
-                                   unsigned int *out_height) {
+static void parse_image_descriptor(struct gif_reader *g, struct gif_rect *r) {
   unsigned char header[IMAGE_DESCRIPTOR_HEADER_SIZE];
-  unsigned int left, top, width, height;
 
   advance_read(g, IMAGE_DESCRIPTOR_HEADER_SIZE, header);
-  READ2BYTES(left, header);
-  READ2BYTES(top, header + 2);
-  READ2BYTES(width, header + 4);
-  READ2BYTES(height, header + 6);
+  READ2BYTES(r->left, header);
+  READ2BYTES(r->top, header + 2);
+  READ2BYTES(r->width, header + 4);
+  READ2BYTES(r->height, header + 6);
   /* check for local color table */
+  g->has_local_clut = 0;
   if (header[8] & 0x80) {
     unsigned int size;
 
@@ -259,105 +701,435 @@ static void parse_image_descriptor(struct gif_reader *g,
     size = local_color_table_size(header[8] & 0x07);
     advance_read(g, size, g->local_clut);
   }
-  *out_left = left;
-  *out_top = top;
-  *out_width = width;
-  *out_height = height;
+  r->interlaced = header[8] & 0x40 ? 1 : 0;
 }
 
+/* Decodes the LZW data after an image descriptor into at most max indices,
+ * a sub-block at a time as it's read. Whatever is left over is skipped */
 static int decompress_image(struct gif_reader *g,
+                            unsigned long max,
                             unsigned long *out_len,
                             unsigned char **out_img) {
-  unsigned char code_size, *img_compressed, *img;
-  long total_bytes;
-  unsigned long pos, size, decompressed_size;
+  unsigned char code_size, size, block[255], *img;
+  unsigned long len;
 
   advance_read(g, 1, &code_size);
-  total_bytes = get_data_size(g);
-  img_compressed = malloc((unsigned long) total_bytes);
-  if (!img_compressed) return -1;
-  size = 0;
-  pos = 0;
+  if (g->error) return -1;
+  if (!g->lzw) g->lzw = malloc(sizeof(struct gif_lzw_decoder));
+  if (!g->lzw) return -1;
+  if (gif_lzw_init(g->lzw, code_size)) return -1;
+  /* never more than the frame's rect, so the output is allocated up front */
+  img = malloc(max ? max : 1);
+  if (!img) return -1;
+  len = 0;
   do {
     advance_read(g, 1, &size);
-    advance_read(g, size, img_compressed + pos);
-    pos += size;
+    advance_read(g, size, block);
+    if (g->error) {
+      free(img);
+      return -1;
+    }
+    g->lzw->in = block;
+    g->lzw->avail = size;
+    len += gif_lzw_decode(g->lzw, img + len, max - len);
   } while (size);
-  lzw_decompress(code_size,
-                 (unsigned long) total_bytes,
-                 img_compressed,
-                 &decompressed_size,
-                 &img);
-  *out_len = decompressed_size;
+  *out_len = len;
   *out_img = img;
-  free(img_compressed);
   return 0;
 }
 
-static void write_image(struct gif_reader *g,
-                        unsigned int left,
-                        unsigned int top,
-                        unsigned int width,
-                        unsigned int height,
-                        unsigned long len,
-                        unsigned char *img) {
-  unsigned char *pal;
+static unsigned int format_bpp(enum gif_pixel_format format) {
+  switch (format) {
+    case GIF_RGB8: return 3;
+    case GIF_RGBA8: return 4;
+    case GIF_BGRA8: return 4;
+    case GIF_RGBA8_PREMUL: return 4;
+    case GIF_RGB565: return 2;
+    default: break;
+  }
+  return 0;
+}
+
+/* Converts a color table to the output format, 4 bytes per entry. Palette
+ * colors are opaque, so premultiplied RGBA is plain RGBA here. RGB565 is
+ * stored as native-endian 16 bit words */
+static void convert_palette(struct gif_reader *g,
+                            unsigned char *pal,
+                            unsigned char *pixels) {
   unsigned int i;
 
-  pal = g->has_local_clut ? g->local_clut : g->global_clut;
+  for (i = 0; i < 256; ++i) {
+    unsigned char r, gr, b, *px;
+
+    r = pal[3 * i + 0];
+    gr = pal[3 * i + 1];
+    b = pal[3 * i + 2];
+    px = pixels + 4 * i;
+    switch (g->format) {
+      case GIF_BGRA8:
+        px[0] = b;
+        px[1] = gr;
+        px[2] = r;
+        px[3] = 0xff;
+        break;
+      case GIF_RGB565: {
+        unsigned short rgb565;
+
+        rgb565 = (unsigned short) (((r >> 3) << 11)
+                                   | ((gr >> 2) << 5)
+                                   | (b >> 3));
+        memcpy(px, &rgb565, sizeof(rgb565));
+      } break;
+      default:
+        px[0] = r;
+        px[1] = gr;
+        px[2] = b;
+        px[3] = 0xff;
+        break;
+    }
+  }
+}
+
+/* Draws w color indices from src at dst using the converted palette */
+static void write_span(struct gif_reader *g,
+                       unsigned char *dst,
+                       unsigned char *src,
+                       unsigned int w,
+                       unsigned char *pixels) {
+  unsigned int bpp;
+
+  bpp = g->bpp;
   if (g->has_trans) {
-    for (i = 0; i < height; ++i) {
-      unsigned char *dst, *src;
-      unsigned int w;
-
-      src = img + (i * width);
-      dst = g->image + 3 * (((i + top) * g->width) + left);
-      w = width;
-      while (w--) {
-        if (*src != g->trans_index) {
-          unsigned int index;
-
-          index = *src * 3;
-          *dst++ = pal[index + 0];
-          *dst++ = pal[index + 1];
-          *dst++ = pal[index + 2];
-        } else {
-          dst++;
-          dst++;
-          dst++;
-        }
-        src++;
-      }
+    /* transparent pixels leave the canvas as it is */
+    while (w--) {
+      if (*src != g->trans_index) memcpy(dst, pixels + 4 * *src, bpp);
+      dst += bpp;
+      src++;
     }
   } else {
-    for (i = 0; i < height; ++i) {
-      unsigned char *dst, *src;
-      unsigned int w;
-
-      src = img + (i * width);
-      dst = g->image + 3 * (((i + top) * g->width) + left);
-      w = width;
-      while (w--) {
-        unsigned int index;
-
-        index = *src * 3;
-        *dst++ = pal[index + 0];
-        *dst++ = pal[index + 1];
-        *dst++ = pal[index + 2];
-        src++;
-      }
+    while (w--) {
+      memcpy(dst, pixels + 4 * *src, bpp);
+      dst += bpp;
+      src++;
     }
   }
 }
 
+/* Row of the image stored i-th in an interlaced image: every 8th row from 0,
+ * every 8th from 4, every 4th from 2, then the odd rows */
+static unsigned int interlaced_row(unsigned int i, unsigned int height) {
+  unsigned int n;
+
+  n = (height + 7) / 8;
+  if (i < n) return 8 * i;
+  i -= n;
+  n = (height + 3) / 8;
+  if (i < n) return 8 * i + 4;
+  i -= n;
+  n = (height + 1) / 4;
+  if (i < n) return 4 * i + 2;
+  i -= n;
+  return 2 * i + 1;
+}
+
+/* Converts the frame's color table, local or global, to the canvas format */
+static void frame_palette(struct gif_reader *g, unsigned char *pixels) {
+  unsigned char *pal;
+
+  pal = g->has_local_clut ? g->local_clut : g->global_clut;
+  convert_palette(g, pal, pixels);
+}
+
+/* Draws the i-th row stored in a frame from its indices in src, as far as
+ * it's on the canvas */
+static int write_row(struct gif_reader *g,
+                     struct gif_rect *r,
+                     unsigned int i,
+                     unsigned char *src,
+                     unsigned char *pixels) {
+  unsigned char *dst;
+  unsigned int bpp, cols, size, x, y;
+
+  if (!r->width || r->left >= g->width || r->top >= g->height) return 0;
+  y = r->interlaced ? interlaced_row(i, r->height) : i;
+  if (y >= g->height - r->top) return 0;
+  y += r->top;
+  cols = r->width;
+  if (cols > g->width - r->left) cols = g->width - r->left;
+  bpp = g->bpp;
+  if (g->image) {
+    dst = g->image + (unsigned long) y * g->stride
+      + (unsigned long) r->left * bpp;
+    write_span(g, dst, src, cols, pixels);
+    return 0;
+  }
+  /* split the row where it crosses into the next tile */
+  size = g->tiles.size;
+  for (x = r->left; x < r->left + cols; ) {
+    unsigned int n;
+
+    n = size - x % size;
+    if (n > r->left + cols - x) n = r->left + cols - x;
+    dst = own_tile(g, x / size, y / size);
+    if (!dst) return -1;
+    dst += bpp * ((unsigned long) (y % size) * size + x % size);
+    write_span(g, dst, src + (x - r->left), n, pixels);
+    x += n;
+  }
+  return 0;
+}
+
+/* Shares the tiles a frame has been drawn on again where they came out
+ * uniform */
+static void settle_rect(struct gif_reader *g, struct gif_rect *r) {
+  unsigned int visible, cols, size, tx, ty;
+
+  if (g->image) return;
+  if (!r->width || r->left >= g->width || r->top >= g->height) return;
+  if (!r->height) return;
+  visible = r->height;
+  if (visible > g->height - r->top) visible = g->height - r->top;
+  cols = r->width;
+  if (cols > g->width - r->left) cols = g->width - r->left;
+  size = g->tiles.size;
+  for (ty = r->top / size; ty <= (r->top + visible - 1) / size; ++ty) {
+    for (tx = r->left / size; tx <= (r->left + cols - 1) / size; ++tx) {
+      settle_tile(g, tx, ty);
+    }
+  }
+}
+
+static int write_image(struct gif_reader *g,
+                       struct gif_rect *r,
+                       unsigned long len,
+                       unsigned char *img) {
+  unsigned char pixels[4 * 256];
+  unsigned int i, rows;
+
+  /* only whole decoded rows are drawn */
+  if (!r->width) return 0;
+  rows = r->height;
+  if (rows > len / r->width) rows = (unsigned int) (len / r->width);
+  if (!rows) return 0;
+  frame_palette(g, pixels);
+  for (i = 0; i < rows; ++i) {
+    if (write_row(g, r, i, img + (unsigned long) i * r->width, pixels)) {
+      return -1;
+    }
+  }
+  settle_rect(g, r);
+  return 0;
+}
+
+/* Checks a frame against the pixel and decoded byte limits. Frames decode
+ * to their rect at most, so that is checked up front */
+static int check_frame(struct gif_reader *g, struct gif_rect *r) {
+  unsigned long n_pixels, max;
+
+  n_pixels = (unsigned long) r->width * r->height;
+  if (g->limits.max_pixels && n_pixels > g->limits.max_pixels) {
+    return set_error(g, GIF_ERR_PIXELS);
+  }
+  max = g->limits.max_decoded;
+  if (max && (g->decoded > max || n_pixels > max - g->decoded)) {
+    return set_error(g, GIF_ERR_DECODED);
+  }
+  return 0;
+}
+
+/* Decodes the image whose descriptor tag has just been read onto the canvas,
+ * within the pixel and decoded byte limits */
+static int decode_frame(struct gif_reader *g) {
+  struct gif_rect r;
+  unsigned char *image;
+  unsigned long len;
+
+  parse_image_descriptor(g, &r);
+  if (check_frame(g, &r)) return g->error;
+  if (decompress_image(g, (unsigned long) r.width * r.height, &len, &image)) {
+    return set_error(g, GIF_ERR);
+  }
+  g->decoded += len;
+  if (write_image(g, &r, len, image)) {
+    free(image);
+    return set_error(g, GIF_ERR);
+  }
+  free(image);
+  return 0;
+}
+
+/* Length of a chain of data sub-blocks, terminator included, or 0 if it
+ * isn't all there yet */
+static unsigned long chain_length(unsigned char *p, unsigned long avail) {
+  unsigned long i;
+
+  i = 0;
+  while (i < avail) {
+    unsigned char size;
+
+    size = p[i];
+    i += 1ul + size;
+    if (!size) return i;
+  }
+  return 0;
+}
+
+/* Length of the header, logical screen and global color table, or 0 */
+static unsigned long stream_header_length(unsigned char *p,
+                                          unsigned long avail) {
+#define GIF_HEADER_SIZE 13
+
+  unsigned long len;
+
+  if (avail < GIF_HEADER_SIZE) return 0;
+  len = GIF_HEADER_SIZE;
+  if (p[10] & 0x80) len += local_color_table_size(p[10] & 0x07);
+  return len <= avail ? len : 0;
+
+#undef GIF_HEADER_SIZE
+}
+
+/* Length of the block starting at p, or 0 if it isn't all there yet. For an
+ * image that's up to its LZW code size: the data sub-blocks are taken one at
+ * a time after that */
+static unsigned long stream_block_length(unsigned char *p,
+                                         unsigned long avail) {
+  unsigned long len, chain;
+
+  switch (p[0]) {
+    case TAG_TRAILER:
+      return 1;
+    case TAG_GRAPHIC_EXTENSION:
+      /* every extension is its label and a chain of sub-blocks */
+      if (avail < 2) return 0;
+      chain = chain_length(p + 2, avail - 2);
+      return chain ? 2 + chain : 0;
+    case TAG_IMAGE_DESCRIPTOR:
+      len = 1 + IMAGE_DESCRIPTOR_HEADER_SIZE;
+      if (avail < len) return 0;
+      if (p[len - 1] & 0x80) len += local_color_table_size(p[len - 1] & 0x07);
+      /* LZW code size */
+      len += 1;
+      return len <= avail ? len : 0;
+    default:
+      break;
+  }
+  return 0;
+}
+
+/* Starts on a streamed image once everything up to its LZW code size has
+ * arrived */
+static int stream_image(struct gif_reader *g) {
+  struct gif_partial *f;
+  unsigned char code_size;
+
+  if (!g->stream.partial) {
+    g->stream.partial = calloc(1, sizeof(struct gif_partial));
+    if (!g->stream.partial) return set_error(g, GIF_ERR);
+  }
+  f = g->stream.partial;
+  parse_image_descriptor(g, &f->rect);
+  if (check_frame(g, &f->rect)) return g->error;
+  advance_read(g, 1, &code_size);
+  if (!g->lzw) g->lzw = malloc(sizeof(struct gif_lzw_decoder));
+  if (!g->lzw) return set_error(g, GIF_ERR);
+  if (gif_lzw_init(g->lzw, code_size)) return set_error(g, GIF_ERR);
+  f->row = malloc(f->rect.width ? f->rect.width : 1);
+  if (!f->row) return set_error(g, GIF_ERR);
+  f->fill = 0;
+  f->n_rows = 0;
+  frame_palette(g, f->pixels);
+  g->stream.in_image = 1;
+  return 0;
+}
+
+/* Decodes the data sub-block at p of the image being streamed, drawing every
+ * row it completes. Returns the gifr_feed status: the frame is done at the
+ * block terminator */
+static int stream_sub_block(struct gif_reader *g, unsigned char *p) {
+  struct gif_partial *f;
+  struct gif_rect *r;
+
+  f = g->stream.partial;
+  r = &f->rect;
+  if (!p[0]) {
+    if (f->n_rows) settle_rect(g, r);
+    free(f->row);
+    f->row = NULL;
+    g->stream.in_image = 0;
+    g->n_frames++;
+    g->frame++;
+    return GIF_FEED_FRAME;
+  }
+  g->lzw->in = p + 1;
+  g->lzw->avail = p[0];
+  /* past the last row, the rest of the data is skipped */
+  while (r->width && f->n_rows < r->height) {
+    unsigned long n;
+
+    n = gif_lzw_decode(g->lzw, f->row + f->fill, r->width - f->fill);
+    f->fill += (unsigned int) n;
+    g->decoded += n;
+    if (f->fill < r->width) break;
+    if (write_row(g, r, f->n_rows, f->row, f->pixels)) {
+      set_error(g, GIF_ERR);
+      return GIF_FEED_ERROR;
+    }
+    f->n_rows++;
+    f->fill = 0;
+  }
+  return GIF_FEED_MORE;
+}
+
+/* Handles one complete block of a stream. Returns the gifr_feed status */
+static int stream_block(struct gif_reader *g, unsigned char *p) {
+  g->meta.src.ptr = p + 1;
+  switch (p[0]) {
+    case TAG_TRAILER:
+      g->stream.ended = 1;
+      return GIF_FEED_END;
+    case TAG_GRAPHIC_EXTENSION:
+      /* a graphic control block with a sub-block of any other size than 4
+       * is malformed, and is skipped like an unknown extension */
+      if (p[1] == TAG_GRAPHIC_CONTROL_LABEL && p[2] == 4) {
+        g->meta.src.ptr = p + 2;
+        graphic_control(g, NULL);
+      }
+      return GIF_FEED_MORE;
+    default:
+      break;
+  }
+  if (g->limits.max_frames && g->n_frames == g->limits.max_frames) {
+    set_error(g, GIF_ERR_FRAMES);
+    return GIF_FEED_ERROR;
+  }
+  return stream_image(g) ? GIF_FEED_ERROR : GIF_FEED_MORE;
+}
+
 /* **************************************** */
 /* Public */
 /* **************************************** */
 
 int gifr_init(struct gif_reader *g, enum gif_source_type type, void *src) {
+  return gifr_init_opts(g, type, src, NULL);
+}
+
+/* Like gifr_init, with the canvas in opts->format rather than packed RGB.
+ * Formats with alpha start out fully transparent, and pixels stay that way
+ * until an opaque pixel is drawn over them */
+int gifr_init_opts(struct gif_reader *g,
+                   enum gif_source_type type,
+                   void *src,
+                   struct gif_reader_opts *opts) {
   if (!g) return -1;
   if (!src) return -1;
   memset(g, 0, sizeof(struct gif_reader));
+  g->format = opts ? opts->format : GIF_RGB8;
+  g->bpp = format_bpp(g->format);
+  if (!g->bpp) return -1;
+  if (set_tile_size(g, opts)) return -1;
+  if (set_canvas(g, opts)) return -1;
+  set_limits(g, opts);
   g->meta.src_type = type;
   switch (g->meta.src_type) {
     case GIF_FILE:
@@ -369,68 +1141,419 @@ int gifr_init(struct gif_reader *g, enum gif_source_type type, void *src) {
     default:
       goto fail;
   }
-  g->global_clut = malloc(3 * 256);
-  if (!g->global_clut) goto fail;
-  g->local_clut = malloc(3 * 256);
+  g->local_clut = calloc(3 * 256, 1);
   if (!g->local_clut) goto fail;
-  if (header(g)) goto fail;
-  if (logical_screen(g)) goto fail;
-  g->image = malloc(g->width * g->height * 3);
-  if (!g->image) goto fail;
-  if (g->meta.src_type == GIF_FILE) {
-    g->meta.start.value = ftell(g->meta.src.file);
-  } else {
-    g->meta.start.ptr = g->meta.src.ptr;
-  }
-  count_images(g);
+  if (parse_stream(g)) goto fail;
+  if (alloc_canvas(g)) goto fail;
+  gifr_head(g);
+  return 0;
+
+fail:
+  gifr_deinit(g);
+  return g->error ? g->error : -1;
+}
+
+/* Opens a reader on a parsed document. It shares the document's data, global
+ * color table and frame count and only owns its canvas and position, so any
+ * number of readers, one per thread, can decode the same document. The
+ * reader keeps the document's limits unless opts sets its own */
+int gifr_init_doc(struct gif_reader *g,
+                  struct gif_doc *d,
+                  struct gif_reader_opts *opts) {
+  if (!g) return -1;
+  if (!d) return -1;
+  *g = d->base;
+  g->meta.doc = d;
+  g->format = opts ? opts->format : GIF_RGB8;
+  g->bpp = format_bpp(g->format);
+  if (!g->bpp) return -1;
+  if (set_tile_size(g, opts)) return -1;
+  if (set_canvas(g, opts)) return -1;
+  set_limits(g, opts);
+  if (check_limits(g)) return g->error;
+  g->local_clut = calloc(3 * 256, 1);
+  if (!g->local_clut) goto fail;
+  if (alloc_canvas(g)) goto fail;
   gifr_head(g);
   return 0;
 
+fail:
+  gifr_deinit(g);
+  return g->error ? g->error : -1;
+}
+
+/* Starts a reader with no source: data is handed over as it arrives with
+ * gifr_feed. Only the block being received is buffered; for an image, that's
+ * its current data sub-block and one row of color indices */
+int gifr_init_stream(struct gif_reader *g, struct gif_reader_opts *opts) {
+  if (!g) return -1;
+  memset(g, 0, sizeof(struct gif_reader));
+  g->format = opts ? opts->format : GIF_RGB8;
+  g->bpp = format_bpp(g->format);
+  if (!g->bpp) return -1;
+  if (set_tile_size(g, opts)) return -1;
+  if (set_canvas(g, opts)) return -1;
+  set_limits(g, opts);
+  /* complete blocks are parsed in place from the stream buffer */
+  g->meta.src_type = GIF_BUFFER;
+  g->stream.active = 1;
+  g->global_clut = calloc(3 * 256, 1);
+  if (!g->global_clut) goto fail;
+  g->local_clut = calloc(3 * 256, 1);
+  if (!g->local_clut) goto fail;
+  return 0;
+
 fail:
   gifr_deinit(g);
   return -1;
 }
 
+/* Appends len bytes to a stream and decodes as far as they go. Frames are
+ * drawn onto the canvas a row at a time as their data arrives. Returns
+ * GIF_FEED_FRAME as soon as a frame is complete, leaving any remaining data
+ * buffered: call again with no bytes to carry on. Returns GIF_FEED_MORE once
+ * it needs more data, with the rows of a frame received so far already
+ * drawn, and GIF_FEED_END at the trailer. After GIF_FEED_ERROR the stream is
+ * dead and g->error holds the reason */
+int gifr_feed(struct gif_reader *g, unsigned char *bytes, unsigned long len) {
+  unsigned char *p;
+  unsigned long avail, size;
+
+  if (!g) return GIF_FEED_ERROR;
+  if (!g->stream.active) return GIF_FEED_ERROR;
+  if (g->error) return GIF_FEED_ERROR;
+  if (g->limits.max_read && len > g->limits.max_read - g->stream.fed) {
+    set_error(g, GIF_ERR_READ);
+    return GIF_FEED_ERROR;
+  }
+  g->stream.fed += len;
+  if (len) {
+    /* drop what's been consumed before growing */
+    if (g->stream.pos) {
+      memmove(g->stream.buf,
+              g->stream.buf + g->stream.pos,
+              g->stream.len - g->stream.pos);
+      g->stream.len -= g->stream.pos;
+      g->stream.pos = 0;
+    }
+    if (g->stream.len + len > g->stream.cap) {
+      unsigned char *tmp;
+      unsigned long cap;
+
+      cap = g->stream.cap ? g->stream.cap : 4096;
+      while (cap < g->stream.len + len) cap *= 2;
+      tmp = realloc(g->stream.buf, cap);
+      if (!tmp) return GIF_FEED_ERROR;
+      g->stream.buf = tmp;
+      g->stream.cap = cap;
+    }
+    memcpy(g->stream.buf + g->stream.len, bytes, len);
+    g->stream.len += len;
+  }
+  for (;;) {
+    int status;
+
+    if (g->stream.ended) return GIF_FEED_END;
+    p = g->stream.buf + g->stream.pos;
+    avail = g->stream.len - g->stream.pos;
+    if (!g->stream.begun) {
+      size = stream_header_length(p, avail);
+      if (!size) return GIF_FEED_MORE;
+      g->meta.src.ptr = p;
+      if (header(g) || logical_screen(g)) {
+        set_error(g, GIF_ERR);
+        return GIF_FEED_ERROR;
+      }
+      if (check_limits(g)) return GIF_FEED_ERROR;
+      if (alloc_canvas(g)) {
+        set_error(g, GIF_ERR);
+        return GIF_FEED_ERROR;
+      }
+      g->stream.begun = 1;
+      g->stream.pos += size;
+      continue;
+    }
+    if (!avail) return GIF_FEED_MORE;
+    if (g->stream.in_image) {
+      size = 1ul + p[0];
+      if (size > avail) return GIF_FEED_MORE;
+      status = stream_sub_block(g, p);
+      g->stream.pos += size;
+      if (status != GIF_FEED_MORE) return status;
+      continue;
+    }
+    if (p[0] != TAG_TRAILER
+        && p[0] != TAG_GRAPHIC_EXTENSION
+        && p[0] != TAG_IMAGE_DESCRIPTOR) {
+      set_error(g, GIF_ERR);
+      return GIF_FEED_ERROR;
+    }
+    size = stream_block_length(p, avail);
+    if (!size) return GIF_FEED_MORE;
+    status = stream_block(g, p);
+    g->stream.pos += size;
+    if (status != GIF_FEED_MORE) return status;
+  }
+}
+
 void gifr_deinit(struct gif_reader *g) {
   if (!g) return;
-  if (g->global_clut) free(g->global_clut);
+  if (g->stream.buf) free(g->stream.buf);
+  if (!g->meta.doc && g->global_clut) free(g->global_clut);
   if (g->local_clut) free(g->local_clut);
-  if (g->image) free(g->image);
+  if (g->image && !g->borrowed) free(g->image);
+  if (g->lzw) free(g->lzw);
+  if (g->stream.partial) {
+    free(g->stream.partial->row);
+    free(g->stream.partial);
+  }
+  free_tiles(g);
+  free_checkpoints(g);
+}
+
+/* Parses a GIF once into a read-only document. File sources are read into
+ * memory, so the document no longer depends on the FILE afterwards, and
+ * reading past the end of a truncated file fails. Only the limits in opts
+ * are used */
+int gifd_init(struct gif_doc *d,
+              enum gif_source_type type,
+              void *src,
+              struct gif_reader_opts *opts) {
+  struct gif_reader *g;
+
+  if (!d) return -1;
+  if (!src) return -1;
+  memset(d, 0, sizeof(struct gif_doc));
+  g = &d->base;
+  set_limits(g, opts);
+  switch (type) {
+    case GIF_FILE:
+      d->data = read_file(g, (FILE *) src);
+      if (!d->data) return g->error ? g->error : -1;
+      src = d->data;
+      break;
+    case GIF_BUFFER:
+      break;
+    default:
+      return -1;
+  }
+  g->meta.src_type = GIF_BUFFER;
+  g->meta.src.ptr = (unsigned char *) src;
+  if (parse_stream(g)) goto fail;
+  gifr_head(g);
+  return 0;
+
+fail:
+  gifd_deinit(d);
+  return d->base.error ? d->base.error : -1;
+}
+
+void gifd_deinit(struct gif_doc *d) {
+  if (!d) return;
+  gifr_deinit(&d->base);
+  if (d->data) free(d->data);
 }
 
 void gifr_head(struct gif_reader *g) {
   if (!g) return;
-  if (g->meta.src_type == GIF_FILE) {
-    fseek(g->meta.src.file, g->meta.start.value, SEEK_SET);
-  } else {
-    g->meta.src.ptr = g->meta.start.ptr;
-  }
+  /* streamed data is gone once it's decoded */
+  if (g->stream.active) return;
+  seek_to(g, 0);
+  /* start over from a blank canvas, as after gifr_init */
+  clear_canvas(g);
+  clear_tiles(g);
+  g->frame = 0;
+  g->stale = 0;
+  g->decoded = 0;
+  g->error = 0;
 }
 
+/* Returns 0 at the end of the animation or on failure, with g->error set to
+ * the reason in the latter case */
 int gifr_next(struct gif_reader *g) {
-  unsigned char *image;
-  unsigned int top, left, width, height;
-  unsigned long len;
-  enum gif_tag tag;
+  if (!g) return 0;
+  if (g->stream.active) return 0;
+  if (g->error) return 0;
+  if (!next_image(g, NULL)) return 0;
+  if (decode_frame(g)) return 0;
+  g->frame++;
+  take_checkpoint(g);
+  return 1;
+}
 
+/* Reads the next frame without decoding it: its graphic control fields go in
+ * f->opts and the image descriptor, local color table and LZW data are copied
+ * as-is into f->data, ready for gifw_write. With no f the frame is skipped.
+ * g->image is left untouched */
+int gifr_next_raw(struct gif_reader *g, struct gif_frame *f) {
   if (!g) return 0;
-  tag = TAG_TRAILER;
-  for (;;) {
-    advance_read(g, 1, &tag);
-    switch (tag) {
-      case TAG_GRAPHIC_CONTROL_LABEL:
-        graphic_control(g);
-        break;
-      case TAG_IMAGE_DESCRIPTOR:
-        goto gif_next_process_image;
-      default:
-        if (skip_section(g, tag)) return 0;
+  if (g->stream.active) return 0;
+  if (f) {
+    f->has_opts = 0;
+    f->len = 0;
+  }
+  if (!next_image(g, f)) return 0;
+  /* the canvas no longer matches the position */
+  g->stale = 1;
+  g->frame++;
+  if (!f) return !skip_section(g, TAG_IMAGE_DESCRIPTOR) && !g->error;
+  return !raw_image(g, f) && !g->error;
+}
+
+/* Keeps a copy of the composited canvas every interval frames as they are
+ * decoded, so gifr_seek can resume from the nearest one. The interval is
+ * widened until the copies fit in budget bytes; an interval of 0 spreads
+ * them evenly over the animation. A budget of 0 means no limit. Tiled
+ * canvases have no checkpoints */
+int gifr_checkpoints(struct gif_reader *g,
+                     unsigned int interval,
+                     unsigned long budget) {
+  unsigned long max_points;
+
+  if (!g) return -1;
+  free_checkpoints(g);
+  if (!g->image) return -1;
+  /* nothing to keep for no frames or an empty screen */
+  if (!g->n_frames || !canvas_size(g)) return 0;
+  max_points = budget ? budget / canvas_size(g) : g->n_frames;
+  if (!max_points) return -1;
+  if (max_points > g->n_frames) max_points = g->n_frames;
+  if (!interval || g->n_frames / interval > max_points) {
+    interval = (unsigned int) ((g->n_frames + max_points - 1) / max_points);
+  }
+  g->cache.interval = interval;
+  g->cache.n_points = g->n_frames / interval;
+  if (!g->cache.n_points) return 0;
+  g->cache.points = calloc(g->cache.n_points, sizeof(struct gif_checkpoint));
+  if (!g->cache.points) {
+    memset(&g->cache, 0, sizeof(g->cache));
+    return -1;
+  }
+  return 0;
+}
+
+/* Composites up to and including frame n, resuming from the current frame or
+ * the nearest checkpoint before n rather than from the first frame */
+int gifr_seek(struct gif_reader *g, unsigned int n) {
+  unsigned int target, best;
+
+  if (!g) return 0;
+  if (n >= g->n_frames) return 0;
+  target = n + 1;
+  best = 0;
+  if (g->cache.points) {
+    unsigned int i;
+
+    i = target / g->cache.interval;
+    while (i && !g->cache.points[i - 1].image) --i;
+    best = i * g->cache.interval;
+  }
+  if (g->stale || g->frame > target || g->frame < best) {
+    if (best) {
+      restore_checkpoint(g, best);
+    } else {
+      gifr_head(g);
     }
   }
-gif_next_process_image:
-  parse_image_descriptor(g, &left, &top, &width, &height);
-  if (decompress_image(g, &len, &image)) return 0;
-  write_image(g, left, top, width, height, len, image);
-  free(image);
+  while (g->frame < target) {
+    if (!gifr_next(g)) return 0;
+  }
   return 1;
 }
+
+/* Composites from now on into buf, size bytes long with rows stride bytes
+ * apart or packed for a stride of 0, or into a canvas of the reader's own
+ * for no buf. Fails with GIF_ERR_CANVAS if buf can't hold the screen. With
+ * keep the picture so far is copied over, so the next frame draws on top of
+ * it; otherwise buf must already hold it, as when the caller keeps a pair of
+ * buffers in step. Nothing is copied to or freed from the caller's buffers,
+ * which makes swapping between gifr_next calls cheap. Flat canvases only */
+int gifr_set_canvas(struct gif_reader *g,
+                    unsigned char *buf,
+                    unsigned long stride,
+                    unsigned long size,
+                    int keep) {
+  unsigned char *old, borrowed;
+  unsigned long old_stride;
+
+  if (!g) return -1;
+  if (!g->image) return -1;
+  old = g->image;
+  old_stride = g->stride;
+  borrowed = buf ? 1 : 0;
+  if (!buf) {
+    if (!g->borrowed) return 0;
+    size = canvas_size(g);
+    buf = malloc(size);
+    if (!buf) return -1;
+    stride = 0;
+    keep = 1;
+  }
+  if (!stride) stride = row_size(g);
+  if (!canvas_fits(g, stride, size)) return GIF_ERR_CANVAS;
+  if (keep && buf != old) copy_rows(g, buf, stride, old, old_stride);
+  if (!g->borrowed) free(old);
+  g->image = buf;
+  g->stride = stride;
+  g->capacity = size;
+  g->borrowed = borrowed;
+  return 0;
+}
+
+/* Copies a w by h rect of the canvas at x, y to dst, with rows stride bytes
+ * apart. Works the same whether or not the canvas is tiled */
+int gifr_read_rect(struct gif_reader *g,
+                   unsigned int x,
+                   unsigned int y,
+                   unsigned int w,
+                   unsigned int h,
+                   unsigned char *dst,
+                   unsigned long stride) {
+  unsigned int i, bpp, size;
+
+  if (!g) return -1;
+  if (!dst) return -1;
+  if (!g->image && !g->tiles.table) return -1;
+  if (x > g->width || w > g->width - x) return -1;
+  if (y > g->height || h > g->height - y) return -1;
+  bpp = g->bpp;
+  size = g->tiles.size;
+  for (i = 0; i < h; ++i, dst += stride) {
+    unsigned char *out, *tile;
+    unsigned int cx, n;
+
+    if (g->image) {
+      memcpy(dst,
+             g->image + (unsigned long) (y + i) * g->stride
+               + (unsigned long) x * bpp,
+             (unsigned long) w * bpp);
+      continue;
+    }
+    out = dst;
+    for (cx = x; cx < x + w; cx += n) {
+      n = size - cx % size;
+      if (n > x + w - cx) n = x + w - cx;
+      tile = gifr_tile(g, cx / size, (y + i) / size);
+      if (tile) {
+        tile += bpp * ((unsigned long) ((y + i) % size) * size + cx % size);
+        memcpy(out, tile, (unsigned long) n * bpp);
+      } else {
+        memset(out, 0, (unsigned long) n * bpp);
+      }
+      out += (unsigned long) n * bpp;
+    }
+  }
+  return 0;
+}
+
+/* Pixels of the tile at column tx, row ty of a tiled canvas, in rows of
+ * tile_size pixels, or NULL if the tile is blank. Tiles are only valid until
+ * the next frame is decoded and must not be written to */
+unsigned char *gifr_tile(struct gif_reader *g,
+                         unsigned int tx,
+                         unsigned int ty) {
+  if (!g) return NULL;
+  if (!g->tiles.table) return NULL;
+  if (tx >= g->tiles.cols || ty >= g->tiles.rows) return NULL;
+  return g->tiles.table[(unsigned long) ty * g->tiles.cols + tx];
+}
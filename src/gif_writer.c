@@ -17,10 +17,10 @@
  */
 
 #include "gif.h"
-#include <darray.h>
-#include <lzw.h>
+#include "gif_lzw.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define WRITE2BYTES(dst, val) ((dst)[0] = val & 0xff, \
                                (dst)[1] = (val >> 8) & 0xff);
@@ -284,14 +284,114 @@ static unsigned char DEFAULT_PALETTE[] = {
   224, 224, 192
 };
 
+/* The color table a frame is quantized against: the global palette or a
+ * local table written after the frame's image descriptor */
+struct gif_clut {
+  unsigned char *colors;
+  unsigned char *lut;
+  unsigned int n_colors;
+  unsigned char code_size;
+  unsigned char local;
+  /* where the frame's transparent index is in colors, or -1 */
+  int trans;
+  /* settings snapshot from the writer, safe to use from any thread */
+  unsigned char mask;
+  unsigned char fit;
+  unsigned char trim;
+  unsigned int lossy;
+  unsigned char defer;
+  unsigned char buf[3 * 256];
+};
+
+struct gif_slot {
+  struct gif_writer *g;
+  struct gif_frame frame;
+  struct gif_opts opts;
+  struct gif_clut clut;
+  unsigned char has_opts;
+  unsigned int left;
+  unsigned int top;
+  unsigned int width;
+  unsigned int height;
+  unsigned int extra_delay;
+  size_t img_cap;
+  unsigned char *img;
+  void *handle;
+  int status;
+};
+
+/* GIF LZW encoder: codes are looked up in an open-addressed hash of
+ * (prefix, pixel) pairs and packed LSB first into 255 byte sub-blocks */
+#define LZW_HASH_SIZE 5003
+#define LZW_WINDOW 8192
+
+struct gif_lzw {
+  long keys[LZW_HASH_SIZE];
+  unsigned short codes[LZW_HASH_SIZE];
+  unsigned long bits;
+  unsigned int n_bits;
+  unsigned int code_size;
+  unsigned int width;
+  unsigned int next;
+  int prefix;
+  unsigned int block_len;
+  unsigned char block[255];
+  /* lossy mode: colors close enough to stand in for each color, nearest
+   * first */
+  unsigned char lossy;
+  unsigned char n_near[256];
+  unsigned char near[256][256];
+  /* deferred clears: a full table is kept for as long as each window of
+   * LZW_WINDOW pixels codes in no more bits per pixel than the first one
+   * did, which took in the table filling up. Counts are of pixels in and
+   * bits out */
+  unsigned char defer;
+  unsigned long n_in;
+  unsigned long n_out;
+  unsigned long win_in;
+  unsigned long win_out;
+  unsigned long rate;
+};
+
+struct gif_near {
+  unsigned long dist;
+  unsigned char index;
+};
+
+struct gif_band {
+  struct gif_clut *clut;
+  unsigned int width;
+  unsigned int height;
+  unsigned char *img;
+  unsigned char *indexed_img;
+  void *handle;
+};
+
 static void write_bytes(struct gif_writer *g,
                         size_t len,
                         unsigned char *bytes) {
+  if (g->meta.failed) return;
   if (g->meta.dst_type == GIF_FILE) {
     fwrite(bytes, len, 1, g->meta.dst.file);
-  } else {
-    dapushn(g->meta.dst.ptr, len, bytes);
+    return;
+  }
+  if (g->meta.len + len > g->meta.cap) {
+    unsigned char *tmp;
+    size_t cap;
+
+    cap = g->meta.cap ? g->meta.cap : 256;
+    while (cap < g->meta.len + len) cap *= 2;
+    tmp = realloc(g->meta.dst.ptr, cap);
+    if (!tmp) {
+      /* the output is incomplete from here on */
+      g->meta.failed = 1;
+      return;
+    }
+    g->meta.dst.ptr = tmp;
+    g->meta.cap = cap;
   }
+  memcpy(g->meta.dst.ptr + g->meta.len, bytes, len);
+  g->meta.len += len;
 }
 
 static void write_byte(struct gif_writer *g, unsigned char byte) {
@@ -380,28 +480,197 @@ static void graphic_control(struct gif_writer *g, struct gif_opts *opts) {
 #undef GRAPHIC_CONTROL_HEADER_SIZE
 }
 
-static void image_descriptor(struct gif_writer *g,
-                             unsigned int left,
-                             unsigned int top,
-                             unsigned int width,
-                             unsigned int height) {
+static int frame_bytes(struct gif_frame *f,
+                       size_t len,
+                       unsigned char *bytes) {
+  if (f->len + len > f->cap) {
+    unsigned char *tmp;
+    size_t cap;
+
+    cap = f->cap ? f->cap : 256;
+    while (cap < f->len + len) cap *= 2;
+    tmp = realloc(f->data, cap);
+    if (!tmp) return -1;
+    f->data = tmp;
+    f->cap = cap;
+  }
+  memcpy(f->data + f->len, bytes, len);
+  f->len += len;
+  return 0;
+}
+
+static int frame_byte(struct gif_frame *f, unsigned char byte) {
+  return frame_bytes(f, 1, &byte);
+}
+
+static int image_descriptor(struct gif_frame *f,
+                            struct gif_clut *clut,
+                            unsigned int left,
+                            unsigned int top,
+                            unsigned int width,
+                            unsigned int height,
+                            int interlace) {
 #define IMAGE_DESCRIPTOR_SIZE 9
 
   unsigned char header[IMAGE_DESCRIPTOR_SIZE];
 
-  write_byte(g, TAG_IMAGE_DESCRIPTOR);
+  if (frame_byte(f, TAG_IMAGE_DESCRIPTOR)) return -1;
   WRITE2BYTES(header + 0, left);
   WRITE2BYTES(header + 2, top);
   WRITE2BYTES(header + 4, width);
   WRITE2BYTES(header + 6, height);
-  /* flags */
+  /* flags: local color table and its size, interlacing */
   header[8] = 0;
-  write_bytes(g, IMAGE_DESCRIPTOR_SIZE, header);
+  if (clut->local) header[8] = (unsigned char) (0x80 | (clut->code_size - 1));
+  if (interlace) header[8] |= 0x40;
+  if (frame_bytes(f, IMAGE_DESCRIPTOR_SIZE, header)) return -1;
+  if (!clut->local) return 0;
+  return frame_bytes(f, clut->n_colors * 3u, clut->colors);
 
 #undef IMAGE_DESCRIPTOR_SIZE
 }
 
-static unsigned char calc_color(struct gif_writer *gw,
+static void clut_settings(struct gif_writer *g, struct gif_clut *c) {
+#define LOSSY_RATE_STEP 16
+
+  /* rate control posterizes by dropping low bits of each channel, and
+   * loosens the lossy LZW threshold */
+  c->mask = (unsigned char) (0xff << g->rate.level);
+  c->lossy = g->lossy + LOSSY_RATE_STEP * g->rate.level;
+  c->trim = (g->flags & GIFW_TRIM_CLUT)
+    || g->effort == GIF_EFFORT_HIGH
+    || g->rate.level;
+  c->fit = g->effort != GIF_EFFORT_LOW || c->trim;
+  c->defer = g->effort == GIF_EFFORT_HIGH;
+
+#undef LOSSY_RATE_STEP
+}
+
+/* Index that must stay exact in a frame with these options, or -1 */
+static int trans_index(struct gif_opts *opts) {
+  return opts && (opts->flags & 0x01) ? opts->trans_index : -1;
+}
+
+/* The transparent index if it's in a table of n_colors, or -1 */
+static int clut_trans(struct gif_opts *opts, unsigned int n_colors) {
+  int trans;
+
+  trans = trans_index(opts);
+  return trans < (int) n_colors ? trans : -1;
+}
+
+static void global_clut(struct gif_writer *g,
+                        struct gif_clut *c,
+                        struct gif_opts *opts) {
+  c->colors = g->palette;
+  c->lut = g->effort == GIF_EFFORT_LOW ? g->lut : NULL;
+  c->n_colors = g->n_colors;
+  c->code_size = g->code_size;
+  c->local = 0;
+  c->trans = clut_trans(opts, c->n_colors);
+  clut_settings(g, c);
+}
+
+/* Builds a local color table holding exactly the colors used by img, after
+ * the transparent color if there is one. Fails if that's more than 256 */
+static int build_local_clut(struct gif_clut *c,
+                            unsigned char *trans,
+                            unsigned int width,
+                            unsigned int height,
+                            unsigned char *img) {
+#define COLOR_HASH_SIZE 1024
+
+  unsigned long keys[COLOR_HASH_SIZE], key, last;
+  unsigned char used[COLOR_HASH_SIZE];
+  unsigned int n, size;
+  size_t i, n_pixels;
+
+  memset(used, 0, sizeof(used));
+  n = 0;
+  last = ~0UL;
+  if (trans) {
+    unsigned long h;
+
+    /* slot 0, where the graphic control block can point at it */
+    key = ((unsigned long) trans[0] << 16)
+      | ((unsigned long) trans[1] << 8)
+      | trans[2];
+    h = ((key * 2654435761UL) & 0xffffffffUL) >> 22;
+    used[h] = 1;
+    keys[h] = key;
+    memcpy(c->buf, trans, 3);
+    n = 1;
+    last = key;
+  }
+  n_pixels = (size_t) width * height;
+  for (i = 0; i < n_pixels; ++i) {
+    unsigned char *px;
+    unsigned long h;
+
+    px = img + 3 * i;
+    key = ((unsigned long) px[0] << 16) | ((unsigned long) px[1] << 8) | px[2];
+    /* runs of the same color are common */
+    if (key == last) continue;
+    last = key;
+    h = ((key * 2654435761UL) & 0xffffffffUL) >> 22;
+    while (used[h] && keys[h] != key) h = (h + 1) & (COLOR_HASH_SIZE - 1);
+    if (used[h]) continue;
+    if (n == 256) return -1;
+    used[h] = 1;
+    keys[h] = key;
+    memcpy(c->buf + 3 * n, px, 3);
+    n++;
+  }
+  /* table sizes are powers of 2, starting at 2 */
+  c->code_size = 1;
+  while ((1u << c->code_size) < n) c->code_size++;
+  size = 1u << c->code_size;
+  memset(c->buf + 3 * n, 0, 3 * (size - n));
+  c->colors = c->buf;
+  c->lut = NULL;
+  c->n_colors = size;
+  c->local = 1;
+  c->trans = trans ? 0 : -1;
+  return 0;
+
+#undef COLOR_HASH_SIZE
+}
+
+static void local_clut(struct gif_writer *g,
+                       struct gif_clut *c,
+                       struct gif_opts *opts,
+                       unsigned char code_size,
+                       unsigned char *palette,
+                       unsigned int width,
+                       unsigned int height,
+                       unsigned char *img) {
+  int trans;
+
+  if (palette) {
+    c->colors = palette;
+    c->lut = NULL;
+    c->code_size = code_size;
+    c->n_colors = 1u << code_size;
+    c->local = 1;
+    c->trans = clut_trans(opts, c->n_colors);
+    clut_settings(g, c);
+    return;
+  }
+  /* the transparent index picks its color from the global palette */
+  trans = clut_trans(opts, g->n_colors);
+  /* too many colors for a fitted table: use the global palette */
+  if (build_local_clut(c,
+                       trans >= 0 ? g->palette + 3 * trans : NULL,
+                       width,
+                       height,
+                       img)) {
+    global_clut(g, c, opts);
+    return;
+  }
+  clut_settings(g, c);
+}
+
+static unsigned char calc_color(struct gif_clut *clut,
                                 unsigned char r,
                                 unsigned char g,
                                 unsigned char b) {
@@ -415,75 +684,930 @@ static unsigned char calc_color(struct gif_writer *gw,
   result.min = ~0UL;
   result.index = 0;
   /* cycle through all colors in the palette */
-  for (i = 0; i < gw->n_colors; ++i) {
+  for (i = 0; i < clut->n_colors; ++i) {
     /* palette RGB */
     unsigned char pr, pg, pb;
     unsigned int index, delta;
 
     index = 3 * i;
-    pr = gw->palette[index + 0];
-    pg = gw->palette[index + 1];
-    pb = gw->palette[index + 2];
+    pr = clut->colors[index + 0];
+    pg = clut->colors[index + 1];
+    pb = clut->colors[index + 2];
     delta = (unsigned int) ((pr - r) * (pr - r));
     delta += (unsigned int) ((pg - g) * (pg - g));
     delta += (unsigned int) ((pb - b) * (pb - b));
     if (delta < result.min) {
       result.min = delta;
       result.index = (unsigned char) i;
+      /* exact match, nothing can beat it */
+      if (!delta) break;
     }
   }
   return result.index;
 }
 
-static int write_image(struct gif_writer *g,
-                       unsigned int width,
-                       unsigned int height,
-                       unsigned char *img) {
-  unsigned char *indexed_img, *compr, *tmp;
+static void quantize_rows(struct gif_clut *clut,
+                          unsigned int width,
+                          unsigned int height,
+                          unsigned char *img,
+                          unsigned char *indexed_img) {
   unsigned int i, j;
-  size_t len;
+  unsigned char mask;
 
-  indexed_img = malloc(width * height);
-  if (!indexed_img) return -1;
+  mask = clut->mask;
   for (i = 0; i < height; ++i) {
     for (j = 0; j < width; ++j) {
       unsigned char red, green, blue;
       size_t index;
 
       index = (i * width) + j;
-      red = img[(3 * index) + 0];
-      green = img[(3 * index) + 1];
-      blue = img[(3 * index) + 2];
-      indexed_img[(i * width) + j] = calc_color(g, red, green, blue);
+      red = img[(3 * index) + 0] & mask;
+      green = img[(3 * index) + 1] & mask;
+      blue = img[(3 * index) + 2] & mask;
+      if (clut->lut) {
+        indexed_img[index] = clut->lut[((red >> 3) << 10)
+                                       | ((green >> 3) << 5)
+                                       | (blue >> 3)];
+      } else {
+        indexed_img[index] = calc_color(clut, red, green, blue);
+      }
     }
   }
-  lzw_compress_gif(g->code_size, width * height, indexed_img, &len, &compr);
-  tmp = compr;
-  write_byte(g, g->code_size);
-  while (len > 255) {
-    write_byte(g, 255);
-    write_bytes(g, 255, tmp);
-    tmp += 255;
-    len -= 255;
-  }
-  write_byte(g, (unsigned char) len);
-  write_bytes(g, len, tmp);
-  write_byte(g, 0);
-  free(compr);
-  free(indexed_img);
+}
+
+/* Nearest palette index for every color with 5 bits per channel, looked up
+ * from the middle of each bucket */
+static int build_lut(struct gif_writer *g) {
+#define LUT_SIZE (1 << 15)
+
+  struct gif_clut clut;
+  unsigned int i;
+
+  /* the table is rebuilt in place for a new palette */
+  if (!g->lut) g->lut = malloc(LUT_SIZE);
+  if (!g->lut) return -1;
+  global_clut(g, &clut, NULL);
+  for (i = 0; i < LUT_SIZE; ++i) {
+    unsigned char red, green, blue;
+
+    red = (unsigned char) ((((i >> 10) & 0x1f) << 3) | 0x04);
+    green = (unsigned char) ((((i >> 5) & 0x1f) << 3) | 0x04);
+    blue = (unsigned char) (((i & 0x1f) << 3) | 0x04);
+    g->lut[i] = calc_color(&clut, red, green, blue);
+  }
   return 0;
+
+#undef LUT_SIZE
 }
 
-/* **************************************** */
-/* Public */
-/* **************************************** */
+static void band_job(void *arg) {
+  struct gif_band *b;
 
-int gifw_init(struct gif_writer *g,
-              unsigned char code_size,
-              unsigned char *palette,
-              unsigned int width,
-              unsigned int height) {
-  if (!g) return -1;
+  b = (struct gif_band *) arg;
+  quantize_rows(b->clut, b->width, b->height, b->img, b->indexed_img);
+}
+
+static void quantize(struct gif_writer *g,
+                     struct gif_clut *clut,
+                     unsigned int width,
+                     unsigned int height,
+                     unsigned char *img,
+                     unsigned char *indexed_img,
+                     int parallel) {
+  struct gif_pool *pool;
+  struct gif_band *bands;
+  unsigned int i, rows, n_bands;
+
+  pool = g->bands.pool;
+  rows = g->bands.rows;
+  if (!parallel || !pool || height <= rows) goto serial;
+  n_bands = (height + rows - 1) / rows;
+  bands = malloc(n_bands * sizeof(struct gif_band));
+  if (!bands) goto serial;
+  for (i = 0; i < n_bands; ++i) {
+    struct gif_band *b;
+    size_t offset;
+
+    b = &bands[i];
+    offset = (size_t) i * rows * width;
+    b->clut = clut;
+    b->width = width;
+    b->height = (i == n_bands - 1) ? height - i * rows : rows;
+    b->img = img + 3 * offset;
+    b->indexed_img = indexed_img + offset;
+    b->handle = pool->submit(pool->ctx, band_job, b);
+    if (!b->handle) band_job(b);
+  }
+  for (i = 0; i < n_bands; ++i) {
+    if (bands[i].handle) pool->wait(pool->ctx, bands[i].handle);
+  }
+  free(bands);
+  return;
+
+serial:
+  quantize_rows(clut, width, height, img, indexed_img);
+}
+
+/* Smallest code size whose codes cover n values */
+static unsigned char bits_for(unsigned int n, unsigned char min) {
+  unsigned char bits;
+
+  bits = min;
+  while ((1u << bits) < n) bits++;
+  return bits;
+}
+
+/* Picks the smallest LZW code size covering the indices the frame actually
+ * uses. With GIFW_TRIM_CLUT the used colors are also packed into a local
+ * table, and the indices remapped, when that shortens the codes. The
+ * transparent color is always kept and follows the remapping */
+static unsigned char fit_clut(struct gif_clut *clut,
+                              size_t n_pixels,
+                              unsigned char *indexed_img) {
+  unsigned char used[256], map[256], colors[3 * 256], code_size, trimmed;
+  unsigned int i, n_used, max;
+  size_t p;
+
+  if (!clut->fit) return bits_for(clut->n_colors, 2);
+  memset(used, 0, sizeof(used));
+  for (p = 0; p < n_pixels; ++p) used[indexed_img[p]] = 1;
+  /* a packed table still needs the transparent color, used or not */
+  if (clut->trim && clut->trans >= 0) used[clut->trans] = 1;
+  max = 0;
+  n_used = 0;
+  for (i = 0; i < 256; ++i) {
+    if (!used[i]) continue;
+    max = i;
+    n_used++;
+  }
+  /* the minimum LZW code size is 2, even for 2 color tables */
+  code_size = bits_for(max + 1, 2);
+  if (!clut->trim) return code_size;
+  trimmed = bits_for(n_used, 2);
+  if (trimmed >= code_size) return code_size;
+  n_used = 0;
+  for (i = 0; i < 256; ++i) {
+    if (!used[i]) continue;
+    map[i] = (unsigned char) n_used;
+    memcpy(colors + 3 * n_used, clut->colors + 3 * i, 3);
+    n_used++;
+  }
+  for (p = 0; p < n_pixels; ++p) indexed_img[p] = map[indexed_img[p]];
+  if (clut->trans >= 0) clut->trans = map[clut->trans];
+  clut->code_size = bits_for(n_used, 1);
+  clut->n_colors = 1u << clut->code_size;
+  memset(colors + 3 * n_used, 0, 3 * (clut->n_colors - n_used));
+  memcpy(clut->buf, colors, 3 * clut->n_colors);
+  clut->colors = clut->buf;
+  clut->local = 1;
+  return trimmed;
+}
+
+static void lzw_clear(struct gif_lzw *z) {
+  memset(z->keys, 0, sizeof(z->keys));
+  z->next = (1u << z->code_size) + 2;
+  z->width = z->code_size + 1;
+  /* the first window takes in the table filling up */
+  z->win_in = z->n_in;
+  z->win_out = z->n_out;
+  z->rate = 0;
+}
+
+/* Moves whole bytes of the bit buffer into the current sub-block, writing the
+ * sub-block out once it's full */
+static int lzw_code(struct gif_lzw *z, struct gif_frame *f, unsigned int code) {
+  z->bits |= (unsigned long) code << z->n_bits;
+  z->n_bits += z->width;
+  z->n_out += z->width;
+  while (z->n_bits >= 8) {
+    z->block[z->block_len++] = (unsigned char) (z->bits & 0xff);
+    z->bits >>= 8;
+    z->n_bits -= 8;
+    if (z->block_len == sizeof(z->block)) {
+      if (frame_byte(f, (unsigned char) z->block_len)) return -1;
+      if (frame_bytes(f, z->block_len, z->block)) return -1;
+      z->block_len = 0;
+    }
+  }
+  return 0;
+}
+
+static int compare_near(const void *a, const void *b) {
+  unsigned long da, db;
+
+  da = ((const struct gif_near *) a)->dist;
+  db = ((const struct gif_near *) b)->dist;
+  return da < db ? -1 : da > db;
+}
+
+/* Lets lzw_write swap a pixel for another of the first n_colors colors
+ * within threshold of it, when that continues the current match. The
+ * transparent index, or -1 for none, is never swapped either way */
+static void lzw_lossy(struct gif_lzw *z,
+                      unsigned char *colors,
+                      unsigned int n_colors,
+                      unsigned int threshold,
+                      int trans) {
+  struct gif_near near[256];
+  unsigned long max;
+  unsigned int i, j, n;
+
+  memset(z->n_near, 0, sizeof(z->n_near));
+  z->lossy = threshold ? 1 : 0;
+  if (!z->lossy) return;
+  max = (unsigned long) threshold * threshold;
+  for (i = 0; i < n_colors; ++i) {
+    if ((int) i == trans) continue;
+    n = 0;
+    for (j = 0; j < n_colors; ++j) {
+      unsigned long dist;
+      int d;
+
+      if (j == i || (int) j == trans) continue;
+      d = colors[3 * i] - colors[3 * j];
+      dist = (unsigned long) (d * d);
+      d = colors[3 * i + 1] - colors[3 * j + 1];
+      dist += (unsigned long) (d * d);
+      d = colors[3 * i + 2] - colors[3 * j + 2];
+      dist += (unsigned long) (d * d);
+      if (dist > max) continue;
+      near[n].dist = dist;
+      near[n].index = (unsigned char) j;
+      n++;
+    }
+    qsort(near, n, sizeof(struct gif_near), compare_near);
+    for (j = 0; j < n; ++j) z->near[i][j] = near[j].index;
+    z->n_near[i] = (unsigned char) n;
+  }
+}
+
+static int lzw_begin(struct gif_lzw *z,
+                     struct gif_frame *f,
+                     unsigned char code_size) {
+  z->code_size = code_size;
+  z->defer = 0;
+  z->n_in = 0;
+  z->n_out = 0;
+  z->bits = 0;
+  z->n_bits = 0;
+  z->block_len = 0;
+  z->prefix = -1;
+  lzw_clear(z);
+  if (frame_byte(f, code_size)) return -1;
+  return lzw_code(z, f, 1u << code_size);
+}
+
+/* Slot of (prefix, k) in the hash, or the free slot it would go in */
+static unsigned int lzw_slot(struct gif_lzw *z, int prefix, unsigned int k) {
+  unsigned int h, disp;
+  long key;
+
+  key = (((long) prefix << 8) | (long) k) + 1;
+  h = (k << 4) ^ (unsigned int) prefix;
+  disp = h ? LZW_HASH_SIZE - h : 1;
+  while (z->keys[h] && z->keys[h] != key) {
+    h = h >= disp ? h - disp : h + LZW_HASH_SIZE - disp;
+  }
+  return h;
+}
+
+/* Whether a full table has stopped paying off, checked once per window.
+ * Rates are in 1/256ths of a bit per pixel */
+static int lzw_worse(struct gif_lzw *z) {
+  unsigned long in, rate;
+  int worse;
+
+  in = z->n_in - z->win_in;
+  if (in < LZW_WINDOW) return 0;
+  rate = ((z->n_out - z->win_out) << 8) / in;
+  worse = z->rate && rate > z->rate;
+  if (!z->rate) z->rate = rate;
+  z->win_in = z->n_in;
+  z->win_out = z->n_out;
+  return worse;
+}
+
+/* Encodes n more color indices. Can be called any number of times between
+ * lzw_begin and lzw_end */
+static int lzw_write(struct gif_lzw *z,
+                     struct gif_frame *f,
+                     unsigned char *pixels,
+                     size_t n) {
+  size_t i;
+
+  for (i = 0; i < n; ++i) {
+    unsigned int k, h;
+
+    k = pixels[i];
+    z->n_in++;
+    if (z->prefix < 0) {
+      z->prefix = (int) k;
+      continue;
+    }
+    h = lzw_slot(z, z->prefix, k);
+    if (!z->keys[h] && z->lossy) {
+      unsigned int j;
+
+      /* carry the match on through a similar color instead */
+      for (j = 0; j < z->n_near[k]; ++j) {
+        unsigned int alt;
+
+        alt = lzw_slot(z, z->prefix, z->near[k][j]);
+        if (z->keys[alt]) {
+          h = alt;
+          break;
+        }
+      }
+    }
+    if (z->keys[h]) {
+      z->prefix = z->codes[h];
+      continue;
+    }
+    if (lzw_code(z, f, (unsigned int) z->prefix)) return -1;
+    if (z->next < GIF_LZW_MAX_CODES) {
+      z->keys[h] = (((long) z->prefix << 8) | (long) k) + 1;
+      z->codes[h] = (unsigned short) z->next++;
+      if (z->next > (1u << z->width) && z->width < 12) z->width++;
+    } else if (!z->defer || lzw_worse(z)) {
+      /* the table is full, or has stopped paying off: start over */
+      if (lzw_code(z, f, 1u << z->code_size)) return -1;
+      lzw_clear(z);
+    }
+    z->prefix = (int) k;
+  }
+  return 0;
+}
+
+/* Writes the last code, end of information and the block terminator */
+static int lzw_end(struct gif_lzw *z, struct gif_frame *f) {
+  if (z->prefix >= 0 && lzw_code(z, f, (unsigned int) z->prefix)) return -1;
+  /* a decoder adds a code for the last one it reads, and may widen its codes
+   * before the end code, just as it would for another pixel */
+  if (z->prefix >= 0 && z->next == (1u << z->width) && z->width < 12) {
+    z->width++;
+  }
+  if (lzw_code(z, f, (1u << z->code_size) + 1)) return -1;
+  if (z->n_bits) {
+    /* pad the last byte out */
+    z->width = 8 - z->n_bits;
+    if (lzw_code(z, f, 0)) return -1;
+  }
+  if (z->block_len) {
+    if (frame_byte(f, (unsigned char) z->block_len)) return -1;
+    if (frame_bytes(f, z->block_len, z->block)) return -1;
+  }
+  return frame_byte(f, 0);
+}
+
+#ifdef GIF_CHECK_LZW
+/* Decodes LZW data as written by write_image, code size byte and sub-blocks
+ * included, into the n indices of out, which has room for one more. Fails
+ * unless there are exactly n followed by the end code, with nothing after it
+ * but zero padding and the block terminator */
+static int lzw_check(unsigned char *data,
+                     size_t len,
+                     unsigned char *out,
+                     size_t n) {
+  struct gif_lzw_decoder *d;
+  size_t pos, got, size;
+  int err;
+
+  if (!len) return -1;
+  d = malloc(sizeof(struct gif_lzw_decoder));
+  if (!d) return -1;
+  err = gif_lzw_init(d, data[0]);
+  pos = 1;
+  got = 0;
+  while (!err) {
+    if (pos >= len) {
+      err = -1;
+      break;
+    }
+    size = data[pos++];
+    if (!size) break;
+    /* a sub-block past the end code, or past the end of the data */
+    if (d->state != GIF_LZW_MORE || size > len - pos) {
+      err = -1;
+      break;
+    }
+    d->in = data + pos;
+    d->avail = size;
+    got += gif_lzw_decode(d, out + got, n + 1 - got);
+    /* left over: more than n indices, or something after the end code */
+    if (d->avail) err = -1;
+    pos += size;
+  }
+  if (!err && (d->state != GIF_LZW_END || got != n || d->bits)) err = -1;
+  if (!err && pos != len) err = -1;
+  free(d);
+  return err;
+}
+#endif
+
+/* Limits lossy LZW to the colors that the code size can express */
+static void lossy_clut(struct gif_lzw *z,
+                       struct gif_clut *clut,
+                       unsigned char code_size) {
+  unsigned int n_colors;
+
+  n_colors = clut->n_colors;
+  if (n_colors > (1u << code_size)) n_colors = 1u << code_size;
+  lzw_lossy(z, clut->colors, n_colors, clut->lossy, clut->trans);
+}
+
+/* Interlaced images store every 8th row from 0, every 8th from 4, every 4th
+ * from 2, then the odd rows */
+static const unsigned int pass_start[] = {0, 4, 2, 1};
+static const unsigned int pass_step[] = {8, 8, 4, 2};
+
+#ifdef GIF_CHECK_LZW
+/* Checks n decoded indices against the ones they were encoded from. Lossy
+ * LZW may only have swapped in the colors near each one */
+static int check_span(struct gif_lzw *z,
+                      unsigned char *got,
+                      unsigned char *want,
+                      size_t n) {
+  size_t i;
+
+  for (i = 0; i < n; ++i) {
+    unsigned int j;
+
+    if (got[i] == want[i]) continue;
+    if (!z->lossy) return -1;
+    for (j = 0; j < z->n_near[want[i]]; ++j) {
+      if (z->near[want[i]][j] == got[i]) break;
+    }
+    if (j == z->n_near[want[i]]) return -1;
+  }
+  return 0;
+}
+
+/* Decodes a frame's LZW data again and compares it with its indices */
+static int check_image(struct gif_lzw *z,
+                       unsigned char *data,
+                       size_t len,
+                       int interlace,
+                       unsigned int width,
+                       unsigned int height,
+                       unsigned char *indexed_img) {
+  unsigned char *out, *row;
+  unsigned int pass, y;
+  size_t n;
+  int err;
+
+  n = (size_t) width * height;
+  out = malloc(n + 1);
+  if (!out) return -1;
+  err = lzw_check(data, len, out, n);
+  if (!err && !interlace) err = check_span(z, out, indexed_img, n);
+  row = out;
+  for (pass = 0; pass < 4 && interlace && !err; ++pass) {
+    for (y = pass_start[pass]; y < height && !err; y += pass_step[pass]) {
+      err = check_span(z, row, indexed_img + (size_t) y * width, width);
+      row += width;
+    }
+  }
+  free(out);
+  return err;
+}
+#endif
+
+/* Appends one run of LZW data for a frame's indices. The lossy settings are
+ * left as they are, so they're only worked out once per frame */
+static int lzw_image(struct gif_frame *f,
+                     unsigned char code_size,
+                     int interlace,
+                     int defer,
+                     unsigned int width,
+                     unsigned int height,
+                     unsigned char *indexed_img) {
+  unsigned int pass, y;
+
+  if (lzw_begin(f->lzw, f, code_size)) return -1;
+  f->lzw->defer = (unsigned char) defer;
+  if (!interlace) {
+    if (lzw_write(f->lzw, f, indexed_img, (size_t) width * height)) return -1;
+  }
+  /* the passes go out as one run of LZW data */
+  for (pass = 0; pass < 4 && interlace; ++pass) {
+    for (y = pass_start[pass]; y < height; y += pass_step[pass]) {
+      if (lzw_write(f->lzw, f, indexed_img + (size_t) y * width, width)) {
+        return -1;
+      }
+    }
+  }
+  return lzw_end(f->lzw, f);
+}
+
+/* Encodes a frame's indices as LZW data. Deferred clears only pay off on
+ * images that look the same throughout, so when the clut asks for them the
+ * frame is encoded both ways and the shorter one kept. With GIF_CHECK_LZW
+ * defined, every frame is decoded again and compared with what went in */
+static int write_image(struct gif_frame *f,
+                       struct gif_clut *clut,
+                       struct gif_opts *opts,
+                       unsigned char code_size,
+                       unsigned int width,
+                       unsigned int height,
+                       unsigned char *indexed_img) {
+  size_t start, mid;
+  int interlace;
+
+  if (!f->lzw) f->lzw = malloc(sizeof(struct gif_lzw));
+  if (!f->lzw) return -1;
+  start = f->len;
+  interlace = opts && opts->interlace;
+  lossy_clut(f->lzw, clut, code_size);
+  if (lzw_image(f, code_size, interlace, 0, width, height, indexed_img)) {
+    return -1;
+  }
+  if (clut->defer) {
+    mid = f->len;
+    if (lzw_image(f,
+                  code_size,
+                  interlace,
+                  1,
+                  width,
+                  height,
+                  indexed_img)) {
+      return -1;
+    }
+    if (f->len - mid < mid - start) {
+      memmove(f->data + start, f->data + mid, f->len - mid);
+      f->len = start + (f->len - mid);
+    } else {
+      f->len = mid;
+    }
+  }
+#ifdef GIF_CHECK_LZW
+  return check_image(f->lzw,
+                     f->data + start,
+                     f->len - start,
+                     interlace,
+                     width,
+                     height,
+                     indexed_img);
+#else
+  (void) start;
+  return 0;
+#endif
+}
+
+static int encode_frame(struct gif_writer *g,
+                        struct gif_opts *opts,
+                        unsigned int left,
+                        unsigned int top,
+                        unsigned int width,
+                        unsigned int height,
+                        unsigned char *img,
+                        struct gif_clut *clut,
+                        struct gif_frame *out,
+                        int parallel) {
+  unsigned char code_size;
+  size_t n_pixels;
+  int err;
+
+  out->len = 0;
+  out->has_opts = opts ? 1 : 0;
+  if (opts) out->opts = *opts;
+  n_pixels = (size_t) width * height;
+  if (n_pixels > out->idx_cap) {
+    unsigned char *tmp;
+
+    tmp = realloc(out->idx, n_pixels);
+    if (!tmp) return -1;
+    out->idx = tmp;
+    out->idx_cap = n_pixels;
+  }
+  quantize(g, clut, width, height, img, out->idx, parallel);
+  /* the color table may shrink, so it's only known after quantizing */
+  code_size = fit_clut(clut, n_pixels, out->idx);
+  /* and the transparent color may have moved with it */
+  if (clut->trans >= 0) out->opts.trans_index = (unsigned char) clut->trans;
+  err = image_descriptor(out,
+                         clut,
+                         left,
+                         top,
+                         width,
+                         height,
+                         opts && opts->interlace);
+  if (!err) {
+    err = write_image(out, clut, opts, code_size, width, height, out->idx);
+  }
+  return err;
+}
+
+/* Crops a frame to the pixels that differ from what is already on screen.
+ * Frames with transparency or that restore the screen afterwards (disposal
+ * 2 and 3) leave the screen contents unknown, so they're never cropped */
+static void trim_frame(struct gif_writer *g,
+                       struct gif_opts *opts,
+                       unsigned int *left,
+                       unsigned int *top,
+                       unsigned int *width,
+                       unsigned int *height,
+                       unsigned char **img) {
+  unsigned char *src, *canvas;
+  unsigned int i, j, w, h, x0, y0, x1, y1, disposal;
+  size_t size;
+
+  src = *img;
+  w = *width;
+  h = *height;
+  disposal = opts ? (opts->flags >> 2) & 0x07u : 0;
+  if ((opts && (opts->flags & 0x01))
+      || disposal > 1
+      || !w
+      || !h
+      || *left + w > g->width
+      || *top + h > g->height) {
+    g->delta.valid = 0;
+    return;
+  }
+  if (!g->delta.canvas) {
+    g->delta.canvas = malloc(3u * g->width * g->height);
+    if (!g->delta.canvas) return;
+  }
+  canvas = g->delta.canvas;
+  if (!g->delta.valid) {
+    /* only a full frame makes the whole screen known */
+    if (w != g->width || h != g->height) return;
+    memcpy(canvas, src, 3u * w * h);
+    g->delta.valid = 1;
+    return;
+  }
+  x0 = w;
+  y0 = h;
+  x1 = 0;
+  y1 = 0;
+  for (i = 0; i < h; ++i) {
+    unsigned char *row, *prev;
+
+    row = src + 3 * (i * w);
+    prev = canvas + 3 * (((*top + i) * g->width) + *left);
+    if (!memcmp(row, prev, 3u * w)) continue;
+    if (i < y0) y0 = i;
+    y1 = i + 1;
+    j = 0;
+    while (j < x0 && !memcmp(row + 3 * j, prev + 3 * j, 3)) ++j;
+    x0 = j;
+    j = w;
+    while (j > x1 && !memcmp(row + 3 * (j - 1), prev + 3 * (j - 1), 3)) --j;
+    x1 = j;
+    memcpy(prev, row, 3u * w);
+  }
+  /* nothing changed: a frame still needs at least one pixel */
+  if (!y1) {
+    x0 = 0;
+    y0 = 0;
+    x1 = 1;
+    y1 = 1;
+  }
+  if (!x0 && !y0 && x1 == w && y1 == h) return;
+  size = 3u * (x1 - x0) * (y1 - y0);
+  if (size > g->delta.crop_cap) {
+    unsigned char *tmp;
+
+    tmp = realloc(g->delta.crop, size);
+    if (!tmp) return;
+    g->delta.crop = tmp;
+    g->delta.crop_cap = size;
+  }
+  for (i = y0; i < y1; ++i) {
+    memcpy(g->delta.crop + 3 * ((i - y0) * (x1 - x0)),
+           src + 3 * ((i * w) + x0),
+           3u * (x1 - x0));
+  }
+  *left += x0;
+  *top += y0;
+  *width = x1 - x0;
+  *height = y1 - y0;
+  *img = g->delta.crop;
+}
+
+/* Writes a frame, graphic control block first */
+static void emit_frame(struct gif_writer *g, struct gif_frame *f) {
+  if (f->has_opts) graphic_control(g, &f->opts);
+  write_bytes(g, f->len, f->data);
+}
+
+static void release_held(struct gif_writer *g) {
+  if (!g->held_frame) return;
+  emit_frame(g, &g->held);
+  g->held_frame = 0;
+}
+
+/* Bytes a frame takes in the output, graphic control block included */
+static unsigned long frame_size(struct gif_frame *f) {
+#define GRAPHIC_CONTROL_SIZE 8
+
+  return (unsigned long) f->len + (f->has_opts ? GRAPHIC_CONTROL_SIZE : 0);
+
+#undef GRAPHIC_CONTROL_SIZE
+}
+
+/* Steers the posterization level so frames fit their share of the budget
+ * left, and drops a frame that would overrun the budget, leaving the
+ * previous one on screen for its delay. Returns 1 if f is dropped */
+static int rate_control(struct gif_writer *g, struct gif_frame *f) {
+#define RATE_LEVEL_MAX 5
+
+  unsigned long used, size, left;
+
+  used = (unsigned long) g->meta.len;
+  if (g->held_frame) used += frame_size(&g->held);
+  size = frame_size(f);
+  left = used < g->rate.max ? g->rate.max - used : 0;
+  if (g->rate.n_frames > g->rate.seen) {
+    unsigned long allowance;
+
+    allowance = left / (g->rate.n_frames - g->rate.seen);
+    if (size > allowance && g->rate.level < RATE_LEVEL_MAX) {
+      g->rate.level++;
+    } else if (2 * size < allowance && g->rate.level) {
+      g->rate.level--;
+    }
+  }
+  g->rate.seen++;
+  /* leave room for the trailer; the first frame is always kept */
+  if (size + 1 <= left || !g->rate.kept) {
+    g->rate.kept++;
+    return 0;
+  }
+  if (f->has_opts
+      && g->held_frame
+      && g->held.has_opts
+      && g->held.opts.delay + f->opts.delay <= 0xffff) {
+    g->held.opts.delay += f->opts.delay;
+  }
+  return 1;
+
+#undef RATE_LEVEL_MAX
+}
+
+/* Writes a pushed frame. When merging duplicates or under a size budget,
+ * the latest frame is held back instead, since its delay may still grow */
+static void commit_frame(struct gif_writer *g, struct gif_frame *f) {
+  struct gif_frame tmp;
+
+  if (g->rate.max && rate_control(g, f)) {
+    /* the delta canvas and duplicate check have already seen the frame,
+     * but it never reaches the screen */
+    g->delta.valid = 0;
+    g->dup.valid = 0;
+    return;
+  }
+  release_held(g);
+  if (!(g->flags & GIFW_MERGE_DUPLICATES) && !g->rate.max) {
+    emit_frame(g, f);
+    return;
+  }
+  /* swap buffers rather than copy */
+  tmp = g->held;
+  g->held = *f;
+  *f = tmp;
+  g->held_frame = 1;
+}
+
+static void hash_frame(unsigned int width,
+                       unsigned int height,
+                       unsigned char *img,
+                       unsigned long *out) {
+  unsigned long a, b;
+  size_t i, size;
+
+  /* two independent 32 bit hashes: FNV-1a and a multiplicative one */
+  a = 2166136261UL;
+  b = 0;
+  size = 3u * width * height;
+  for (i = 0; i < size; ++i) {
+    a = ((a ^ img[i]) * 16777619UL) & 0xffffffffUL;
+    b = ((b + img[i] + 1) * 2654435761UL) & 0xffffffffUL;
+  }
+  out[0] = a;
+  out[1] = b;
+}
+
+/* Checks whether a pushed frame repeats the previous one. If it does, its
+ * delay is added to the previous frame, which hasn't been written yet, and
+ * the frame is dropped */
+static int merge_duplicate(struct gif_writer *g,
+                           struct gif_opts *opts,
+                           unsigned int left,
+                           unsigned int top,
+                           unsigned int width,
+                           unsigned int height,
+                           unsigned char *img) {
+  unsigned long hash[2];
+  int same;
+
+  if (!(g->flags & GIFW_MERGE_DUPLICATES)) return 0;
+  hash_frame(width, height, img, hash);
+  same = g->dup.valid
+    && opts
+    && g->dup.has_opts
+    && hash[0] == g->dup.hash[0]
+    && hash[1] == g->dup.hash[1]
+    && left == g->dup.left
+    && top == g->dup.top
+    && width == g->dup.width
+    && height == g->dup.height
+    && opts->flags == g->dup.opts.flags
+    && opts->trans_index == g->dup.opts.trans_index
+    /* the delay is only 2 bytes */
+    && g->dup.opts.delay + opts->delay <= 0xffff;
+  if (same && g->queue.count) {
+    struct gif_slot *s;
+    unsigned int last;
+
+    last = (g->queue.head + g->queue.count - 1) % g->queue.n_slots;
+    s = &g->queue.slots[last];
+    s->extra_delay += opts->delay;
+    g->dup.opts.delay += opts->delay;
+    return 1;
+  }
+  if (same && g->held_frame) {
+    g->held.opts.delay += opts->delay;
+    g->dup.opts.delay += opts->delay;
+    return 1;
+  }
+  g->dup.valid = 1;
+  g->dup.hash[0] = hash[0];
+  g->dup.hash[1] = hash[1];
+  g->dup.left = left;
+  g->dup.top = top;
+  g->dup.width = width;
+  g->dup.height = height;
+  g->dup.has_opts = opts ? 1 : 0;
+  if (opts) g->dup.opts = *opts;
+  return 0;
+}
+
+static void encode_job(void *arg) {
+  struct gif_slot *s;
+
+  s = (struct gif_slot *) arg;
+  /* already on a worker: don't split the frame into bands as well */
+  s->status = encode_frame(s->g,
+                           s->has_opts ? &s->opts : NULL,
+                           s->left,
+                           s->top,
+                           s->width,
+                           s->height,
+                           s->img,
+                           &s->clut,
+                           &s->frame,
+                           0);
+}
+
+static void retire_slot(struct gif_writer *g) {
+  struct gif_slot *s;
+
+  s = &g->queue.slots[g->queue.head];
+  if (s->handle) g->queue.pool->wait(g->queue.pool->ctx, s->handle);
+  s->handle = NULL;
+  if (!s->status) {
+    s->frame.opts.delay += s->extra_delay;
+    commit_frame(g, &s->frame);
+  } else {
+    /* the frame is lost, so the GIF is no good either */
+    g->meta.failed = 1;
+  }
+  g->queue.head = (g->queue.head + 1) % g->queue.n_slots;
+  g->queue.count--;
+}
+
+/* Waits for the frames in flight and throws them away */
+static void drop_queue(struct gif_writer *g) {
+  while (g->queue.count) {
+    struct gif_slot *s;
+
+    s = &g->queue.slots[g->queue.head];
+    if (s->handle) g->queue.pool->wait(g->queue.pool->ctx, s->handle);
+    s->handle = NULL;
+    g->queue.head = (g->queue.head + 1) % g->queue.n_slots;
+    g->queue.count--;
+  }
+}
+
+static void free_queue(struct gif_writer *g) {
+  unsigned int i;
+
+  if (!g->queue.slots) return;
+  for (i = 0; i < g->queue.n_slots; ++i) {
+    gifw_frame_deinit(&g->queue.slots[i].frame);
+    free(g->queue.slots[i].img);
+  }
+  free(g->queue.slots);
+  memset(&g->queue, 0, sizeof(g->queue));
+}
+
+/* Sets up the screen and writes everything that comes before the frames */
+static void begin(struct gif_writer *g,
+                  unsigned char code_size,
+                  unsigned char *palette,
+                  unsigned int width,
+                  unsigned int height) {
   g->width = width;
   g->height = height;
   if (palette) {
@@ -495,12 +1619,28 @@ int gifw_init(struct gif_writer *g,
     g->n_colors = 256;
     g->palette = DEFAULT_PALETTE;
   }
-  g->meta.dst_type = GIF_BUFFER;
-  g->meta.dst.ptr = danew(g->width * g->height);
-  if (!g->meta.dst.ptr) return -1;
   header(g);
   logical_screen(g);
   netscape_loop(g);
+}
+
+/* **************************************** */
+/* Public */
+/* **************************************** */
+
+int gifw_init(struct gif_writer *g,
+              unsigned char code_size,
+              unsigned char *palette,
+              unsigned int width,
+              unsigned int height) {
+  if (!g) return -1;
+  memset(g, 0, sizeof(struct gif_writer));
+  g->meta.dst_type = GIF_BUFFER;
+  g->meta.cap = (size_t) width * height;
+  if (!g->meta.cap) g->meta.cap = 256;
+  g->meta.dst.ptr = malloc(g->meta.cap);
+  if (!g->meta.dst.ptr) return -1;
+  begin(g, code_size, palette, width, height);
   return 0;
 }
 
@@ -512,19 +1652,440 @@ void gifw_push(struct gif_writer *g,
                unsigned int height,
                unsigned char *img) {
   if (!g) return;
-  if (opts) graphic_control(g, opts);
-  image_descriptor(g, left, top, width, height);
-  write_image(g, width, height, img);
-  return;
+  /* a frame of rows is still being written */
+  if (g->rows.active) return;
+  /* keep output in push order behind any frames still being encoded */
+  gifw_flush(g);
+  if (merge_duplicate(g, opts, left, top, width, height, img)) return;
+  if (g->effort == GIF_EFFORT_HIGH) {
+    trim_frame(g, opts, &left, &top, &width, &height, &img);
+  }
+  if (gifw_encode(g, opts, left, top, width, height, img, &g->frame)) {
+    g->meta.failed = 1;
+    return;
+  }
+  commit_frame(g, &g->frame);
+}
+
+/* Like gifw_push, but quantizes the frame against its own color table of
+ * 2 ^ code_size colors. With no palette, a table is fitted to the colors in
+ * img, falling back to the global palette past 256 colors */
+void gifw_push_local(struct gif_writer *g,
+                     struct gif_opts *opts,
+                     unsigned char code_size,
+                     unsigned char *palette,
+                     unsigned int left,
+                     unsigned int top,
+                     unsigned int width,
+                     unsigned int height,
+                     unsigned char *img) {
+  if (!g) return;
+  if (g->rows.active) return;
+  gifw_flush(g);
+  if (merge_duplicate(g, opts, left, top, width, height, img)) return;
+  if (g->effort == GIF_EFFORT_HIGH) {
+    trim_frame(g, opts, &left, &top, &width, &height, &img);
+  }
+  if (gifw_encode_local(g,
+                        opts,
+                        code_size,
+                        palette,
+                        left,
+                        top,
+                        width,
+                        height,
+                        img,
+                        &g->frame)) {
+    g->meta.failed = 1;
+    return;
+  }
+  commit_frame(g, &g->frame);
+}
+
+/* Encodes a frame into out without touching the output stream. Only reads the
+ * writer, so several frames may be encoded concurrently. out is reused and
+ * grown as needed */
+int gifw_encode(struct gif_writer *g,
+                struct gif_opts *opts,
+                unsigned int left,
+                unsigned int top,
+                unsigned int width,
+                unsigned int height,
+                unsigned char *img,
+                struct gif_frame *out) {
+  struct gif_clut clut;
+
+  if (!g) return -1;
+  if (!out) return -1;
+  global_clut(g, &clut, opts);
+  return encode_frame(g, opts, left, top, width, height, img, &clut, out, 1);
+}
+
+int gifw_encode_local(struct gif_writer *g,
+                      struct gif_opts *opts,
+                      unsigned char code_size,
+                      unsigned char *palette,
+                      unsigned int left,
+                      unsigned int top,
+                      unsigned int width,
+                      unsigned int height,
+                      unsigned char *img,
+                      struct gif_frame *out) {
+  struct gif_clut clut;
+
+  if (!g) return -1;
+  if (!out) return -1;
+  if (palette && (code_size < 1 || code_size > 8)) return -1;
+  local_clut(g, &clut, opts, code_size, palette, width, height, img);
+  return encode_frame(g, opts, left, top, width, height, img, &clut, out, 1);
+}
+
+void gifw_write(struct gif_writer *g, struct gif_frame *f) {
+  if (!g) return;
+  if (!f) return;
+  if (g->rows.active) return;
+  /* frames pushed earlier go first */
+  gifw_flush(g);
+  release_held(g);
+  /* the screen is no longer what the duplicate and delta checks think */
+  g->dup.valid = 0;
+  g->delta.valid = 0;
+  emit_frame(g, f);
+}
+
+void gifw_frame_deinit(struct gif_frame *f) {
+  if (!f) return;
+  if (f->data) free(f->data);
+  if (f->idx) free(f->idx);
+  if (f->lzw) free(f->lzw);
+  memset(f, 0, sizeof(struct gif_frame));
+}
+
+/* Splits the palette lookup of each frame into bands of rows quantized on
+ * pool. The result is identical to the serial path. Frames encoded by
+ * gifw_push_async are never split, but pool must not be one whose workers
+ * call gifw_encode themselves */
+int gifw_bands(struct gif_writer *g,
+               struct gif_pool *pool,
+               unsigned int rows) {
+#define BAND_ROWS_DEFAULT 64
+
+  if (!g) return -1;
+  g->bands.pool = pool;
+  g->bands.rows = rows ? rows : BAND_ROWS_DEFAULT;
+  return 0;
+
+#undef BAND_ROWS_DEFAULT
+}
+
+/* Keeps the whole output within max_bytes. Frames are posterized harder,
+ * coded more lossily and have their colors packed into fitted tables while
+ * they run over their share of what's left for the n_frames expected;
+ * frames that would still overrun the budget are dropped and their delay
+ * given to the previous frame. The first frame is always kept, and
+ * gifw_finish fails if that alone breaks the budget. n_frames may be 0 if
+ * unknown. A max_bytes of 0 lifts the limit */
+int gifw_budget(struct gif_writer *g,
+                unsigned long max_bytes,
+                unsigned int n_frames) {
+  if (!g) return -1;
+  gifw_flush(g);
+  g->rate.max = max_bytes;
+  g->rate.n_frames = n_frames;
+  g->rate.seen = 0;
+  g->rate.kept = 0;
+  g->rate.level = 0;
+  return 0;
+}
+
+/* Trades encoding speed for output size. GIF_EFFORT_LOW quantizes through a
+ * 32K lookup table and keeps each table's code size. GIF_EFFORT_HIGH packs
+ * each frame's colors into a fitted table, crops frames to the area that
+ * changed since the previous one, and also tries keeping full LZW tables
+ * instead of clearing them */
+int gifw_effort(struct gif_writer *g, enum gif_effort effort) {
+  if (!g) return -1;
+  /* frames in flight may be reading the lookup table */
+  gifw_flush(g);
+  if (effort == GIF_EFFORT_LOW && !g->lut && build_lut(g)) return -1;
+  g->effort = effort;
+  g->delta.valid = 0;
+  return 0;
+}
+
+/* Lets the LZW coder swap pixels for palette colors up to threshold away,
+ * as a distance in RGB, when that extends the current match. Longer matches
+ * mean fewer codes: this trades a little noise for a much smaller file on
+ * photographic content. 0 turns it off */
+int gifw_lossy(struct gif_writer *g, unsigned int threshold) {
+  if (!g) return -1;
+  /* frames in flight keep the threshold they were pushed with */
+  g->lossy = threshold;
+  return 0;
+}
+
+/* Hands frames pushed with gifw_push_async to pool, keeping at most depth of
+ * them in flight. Frames are still written in push order */
+int gifw_async(struct gif_writer *g,
+               struct gif_pool *pool,
+               unsigned int depth) {
+  if (!g) return -1;
+  if (!pool) return -1;
+  if (!depth) return -1;
+  gifw_flush(g);
+  free_queue(g);
+  g->queue.slots = calloc(depth, sizeof(struct gif_slot));
+  if (!g->queue.slots) return -1;
+  g->queue.pool = pool;
+  g->queue.n_slots = depth;
+  return 0;
+}
+
+int gifw_push_async(struct gif_writer *g,
+                    struct gif_opts *opts,
+                    unsigned int left,
+                    unsigned int top,
+                    unsigned int width,
+                    unsigned int height,
+                    unsigned char *img) {
+  struct gif_slot *s;
+  size_t size;
+
+  if (!g) return -1;
+  if (g->rows.active) return -1;
+  if (!g->queue.slots) {
+    gifw_push(g, opts, left, top, width, height, img);
+    return 0;
+  }
+  if (merge_duplicate(g, opts, left, top, width, height, img)) return 0;
+  /* backpressure: wait for the oldest frame once the queue is full */
+  if (g->queue.count == g->queue.n_slots) retire_slot(g);
+  if (g->effort == GIF_EFFORT_HIGH && !g->rate.max) {
+    trim_frame(g, opts, &left, &top, &width, &height, &img);
+  } else {
+    /* under a budget, a frame in flight may yet be dropped, and frames
+     * cropped against it would be wrong */
+    g->delta.valid = 0;
+  }
+  s = &g->queue.slots[(g->queue.head + g->queue.count) % g->queue.n_slots];
+  /* the caller may reuse img as soon as we return */
+  size = 3u * width * height;
+  if (size > s->img_cap) {
+    unsigned char *tmp;
+
+    tmp = realloc(s->img, size);
+    if (!tmp) return -1;
+    s->img = tmp;
+    s->img_cap = size;
+  }
+  memcpy(s->img, img, size);
+  s->g = g;
+  s->has_opts = opts ? 1 : 0;
+  if (opts) s->opts = *opts;
+  s->left = left;
+  s->top = top;
+  s->width = width;
+  s->height = height;
+  global_clut(g, &s->clut, opts);
+  s->extra_delay = 0;
+  s->status = -1;
+  g->queue.count++;
+  s->handle = g->queue.pool->submit(g->queue.pool->ctx, encode_job, s);
+  if (!s->handle) encode_job(s);
+  return 0;
+}
+
+/* Waits for every frame in flight and writes them in push order */
+void gifw_flush(struct gif_writer *g) {
+  if (!g) return;
+  while (g->queue.count) retire_slot(g);
+}
+
+/* Starts a frame that is handed over a band of rows at a time with
+ * gifw_push_rows, so neither the RGB frame nor its indices are ever held
+ * whole. Rows are quantized against the global palette and written out as
+ * they are encoded, so these frames are never merged, cropped, fitted,
+ * interlaced or dropped for a budget. Until gifw_end_frame, other frames
+ * are refused and the writer can't be finished or reset */
+int gifw_begin_frame(struct gif_writer *g,
+                     struct gif_opts *opts,
+                     unsigned int left,
+                     unsigned int top,
+                     unsigned int width,
+                     unsigned int height) {
+  struct gif_clut clut;
+  struct gif_frame *f;
+
+  if (!g) return -1;
+  if (g->rows.active) return -1;
+  if (!width) return -1;
+  gifw_flush(g);
+  release_held(g);
+  /* the screen is no longer what the duplicate and delta checks think */
+  g->dup.valid = 0;
+  g->delta.valid = 0;
+  f = &g->frame;
+  if (!f->lzw) f->lzw = malloc(sizeof(struct gif_lzw));
+  if (!f->lzw) return -1;
+  if (width > f->idx_cap) {
+    unsigned char *tmp;
+
+    tmp = realloc(f->idx, width);
+    if (!tmp) return -1;
+    f->idx = tmp;
+    f->idx_cap = width;
+  }
+  global_clut(g, &clut, opts);
+  f->len = 0;
+  f->has_opts = opts ? 1 : 0;
+  if (opts) f->opts = *opts;
+  if (image_descriptor(f, &clut, left, top, width, height, 0)) return -1;
+  if (lzw_begin(f->lzw, f, bits_for(clut.n_colors, 2))) return -1;
+  lossy_clut(f->lzw, &clut, bits_for(clut.n_colors, 2));
+  emit_frame(g, f);
+  f->len = 0;
+  g->rows.width = width;
+  g->rows.remaining = height;
+  g->rows.active = 1;
+  return 0;
+}
+
+/* Quantizes and encodes the next n_rows rows of the frame, 3 bytes per
+ * pixel. Fails past the frame's height */
+int gifw_push_rows(struct gif_writer *g,
+                   unsigned int n_rows,
+                   unsigned char *img) {
+  struct gif_clut clut;
+  struct gif_frame *f;
+  unsigned int i;
+  int err;
+
+  if (!g) return -1;
+  if (!g->rows.active) return -1;
+  if (n_rows > g->rows.remaining) return -1;
+  f = &g->frame;
+  global_clut(g, &clut, NULL);
+  err = 0;
+  for (i = 0; i < n_rows && !err; ++i) {
+    quantize_rows(&clut, g->rows.width, 1, img, f->idx);
+    err = lzw_write(f->lzw, f, f->idx, g->rows.width);
+    img += 3u * g->rows.width;
+  }
+  g->rows.remaining -= i;
+  write_bytes(g, f->len, f->data);
+  f->len = 0;
+  return err;
+}
+
+/* Closes a frame started with gifw_begin_frame. Rows that were never pushed
+ * are filled with color 0 so the output stays readable, and make this fail */
+int gifw_end_frame(struct gif_writer *g) {
+  struct gif_frame *f;
+  unsigned int missing;
+  int err;
 
-#undef CODE_SIZE_DEFAULT
+  if (!g) return -1;
+  if (!g->rows.active) return -1;
+  f = &g->frame;
+  missing = g->rows.remaining;
+  memset(f->idx, 0, g->rows.width);
+  err = 0;
+  while (g->rows.remaining && !err) {
+    err = lzw_write(f->lzw, f, f->idx, g->rows.width);
+    g->rows.remaining--;
+  }
+  if (!err) err = lzw_end(f->lzw, f);
+  write_bytes(g, f->len, f->data);
+  f->len = 0;
+  g->rows.active = 0;
+  return err || missing ? -1 : 0;
+}
+
+/* Writes the trailer and returns the GIF. The data stays owned by the
+ * writer, and is only valid until gifw_reset or gifw_deinit. Fails if a
+ * pushed frame couldn't be encoded, or if the GIF is over the budget, which
+ * happens when even the first frame doesn't fit; the data is still in
+ * g->meta then */
+int gifw_finish(struct gif_writer *g,
+                size_t *out_len,
+                unsigned char **out_img) {
+  if (!g) return -1;
+  if (g->rows.active) return -1;
+  gifw_flush(g);
+  release_held(g);
+  write_byte(g, TAG_TRAILER);
+  if (g->meta.failed) return -1;
+  if (g->rate.max && g->meta.len > g->rate.max) return -1;
+  *out_len = g->meta.len;
+  *out_img = g->meta.dst.ptr;
+  return 0;
+}
+
+/* Starts a new GIF, dropping whatever was written so far. The output buffer,
+ * frame buffers, LZW tables and async queue are kept and only ever grow, so
+ * a long-lived writer stops allocating once it has seen its largest GIF.
+ * Flags, effort, bands and the async pool carry over; a budget has to be set
+ * again. The lookup table is kept as long as the palette is the same. Fails
+ * while a frame from gifw_begin_frame is open */
+int gifw_reset(struct gif_writer *g,
+               unsigned char code_size,
+               unsigned char *palette,
+               unsigned int width,
+               unsigned int height) {
+  unsigned char *old_palette;
+  unsigned int old_colors;
+
+  if (!g) return -1;
+  if (g->meta.dst_type != GIF_BUFFER) return -1;
+  if (g->rows.active) return -1;
+  drop_queue(g);
+  old_palette = g->palette;
+  old_colors = g->n_colors;
+  if ((size_t) width * height != (size_t) g->width * g->height) {
+    /* the delta canvas is only ever allocated at the screen size */
+    if (g->delta.canvas) free(g->delta.canvas);
+    g->delta.canvas = NULL;
+  }
+  g->delta.valid = 0;
+  memset(&g->rate, 0, sizeof(g->rate));
+  memset(&g->dup, 0, sizeof(g->dup));
+  memset(&g->rows, 0, sizeof(g->rows));
+  g->held_frame = 0;
+  g->meta.len = 0;
+  g->meta.failed = 0;
+  begin(g, code_size, palette, width, height);
+  if (g->lut && (g->palette != old_palette || g->n_colors != old_colors)) {
+    if (build_lut(g)) return -1;
+  }
+  return 0;
 }
 
+void gifw_deinit(struct gif_writer *g) {
+  if (!g) return;
+  drop_queue(g);
+  free_queue(g);
+  gifw_frame_deinit(&g->frame);
+  gifw_frame_deinit(&g->held);
+  if (g->lut) free(g->lut);
+  if (g->delta.canvas) free(g->delta.canvas);
+  if (g->delta.crop) free(g->delta.crop);
+  if (g->meta.dst_type == GIF_BUFFER && g->meta.dst.ptr) {
+    free(g->meta.dst.ptr);
+  }
+  memset(g, 0, sizeof(struct gif_writer));
+}
+
+/* Finishes the GIF and frees the writer, handing the data over to the
+ * caller to free. On failure the data is NULL */
 void gifw_end(struct gif_writer *g,
               size_t *out_len,
               unsigned char **out_img) {
   if (!g) return;
-  write_byte(g, TAG_TRAILER);
-  *out_len = dalen(g->meta.dst.ptr);
-  *out_img = dapeel(g->meta.dst.ptr);
+  if (gifw_finish(g, out_len, out_img)) {
+    *out_len = 0;
+    *out_img = NULL;
+  } else {
+    g->meta.dst.ptr = NULL;
+  }
+  gifw_deinit(g);
 }